@@ -1,7 +1,19 @@
 #include "Instrument.h"
 
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/InstIterator.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 
 #include "llvm/Support/CommandLine.h"
 #include <iostream>
@@ -9,6 +21,22 @@
 #define DEBUG_TYPE "instrument-function"
 using namespace llvm;
 
+STATISTIC(NumParallelBodies, "Top-level loop bodies left unchecked as proven parallel");
+STATISTIC(NumPrivateAccesses, "Accesses to private or read-only memory left unchecked");
+STATISTIC(NumRangeChecks, "Accesses checked once per loop by a range check");
+STATISTIC(NumRedundantChecks, "Checks removed as dominated by the same check");
+STATISTIC(NumInlineChecks, "Checks given an inline shadow memory fast path");
+STATISTIC(NumHoistedChecks, "Checks of loop-invariant pointers moved out of loops");
+
+static cl::opt<bool> EnableRangeChecks("enable-range-checks", cl::init(true),
+    cl::desc("Check strided accesses of inner loops once, before the loop"));
+
+static cl::opt<bool> InlineShadowChecks("inline-shadow-checks", cl::init(false),
+    cl::desc("Look up the shadow memory inline before calling into threadlib"));
+
+static cl::opt<bool> EnableCheckElimination("enable-check-elimination", cl::init(true),
+    cl::desc("Remove redundant checks and hoist loop-invariant ones"));
+
 std::map<Function *, Function *> InstrumentFunctionPass::FunctionMap;
 
 void InstrumentFunctionPass::collectCalledFunctions(Function *F){
@@ -50,6 +78,56 @@ void InstrumentFunctionPass::instrumentFunction(Function *F){
   collectCalledFunctions(F); 
 }
 
+bool InstrumentFunctionPass::isNested(Function *F){
+  for(User *U : F->users()){
+    auto *I = dyn_cast<Instruction>(U);
+    if(!I || Generated.find(I->getFunction()) != Generated.end()) return true;
+  }
+  return false;
+}
+
+bool InstrumentFunctionPass::startsLoops(Function *F, std::set<Function *> &Visited){
+  if(!Visited.insert(F).second) return false;
+
+  for(Instruction &I : instructions(F)){
+    auto *Call = dyn_cast<CallBase>(&I);
+    if(!Call || isa<IntrinsicInst>(Call)) continue;
+
+    Function *Callee = Call->getCalledFunction();
+    if(!Callee) return true;
+
+    StringRef Name = Callee->getName();
+    if(Name == "__enqueue_task" || Name == "__enqueue_parallel_task") return true;
+    if(!Callee->isDeclaration() && startsLoops(Callee, Visited)) return true;
+  }
+  return false;
+}
+
+bool InstrumentFunctionPass::isPrivateOrReadOnly(Function *F, Instruction *I, bool TopLevel){
+  AAResults &AA = FAM->getResult<AAManager>(*F);
+  MemoryLocation Loc = MemoryLocation::get(I);
+
+  // Each call of F gets its own frame
+  const Value *Object = getUnderlyingObject(Loc.Ptr);
+  if(isa<AllocaInst>(Object) && !PointerMayBeCaptured(Object, true, true)) return true;
+
+  if(auto *Global = dyn_cast<GlobalVariable>(Object)){
+    if(Global->isConstant()) return true;
+  }
+
+  if(isa<StoreInst>(I)) return false;
+  if(AA.pointsToConstantMemory(Loc)) return true;
+
+  // Tasks of a top-level loop that starts no nested loops only run F, so
+  // memory F never writes can't change while the loop runs. Nested loops
+  // and the rest of F after them run as tasks of the same job
+  if(!TopLevel) return false;
+  for(Instruction &W : instructions(F)){
+    if(W.mayWriteToMemory() && isModSet(AA.getModRefInfo(&W, Loc))) return false;
+  }
+  return true;
+}
+
 void InstrumentFunctionPass::addVersioningAndConflictDetection(Function *F){
   Module *M = F->getParent();
   DataLayout Layout = M->getDataLayout();
@@ -81,7 +159,7 @@ void InstrumentFunctionPass::addVersioningAndConflictDetection(Function *F){
   }
   
   if(!CheckLoadConflict){
-    std::vector<Type *> ArgTy = {PtrTy};
+    std::vector<Type *> ArgTy = {PtrTy, I64Ty};
  
     FunctionType *FuncType = FunctionType::get(
         PointerType::getUnqual(M->getContext()), 
@@ -100,6 +178,9 @@ void InstrumentFunctionPass::addVersioningAndConflictDetection(Function *F){
   A++;
   
   Value *Ptr = A++;
+  std::set<Function *> Visited;
+  bool TopLevel = GeneratedF && !isNested(F) && !startsLoops(F, Visited);
+  std::vector<Instruction *> Accesses;
   for(auto I = inst_begin(F), E = inst_end(F); I != E; I++){
     if(auto *Store = dyn_cast<StoreInst>(&*I)){
       if(GeneratedF){
@@ -109,15 +190,11 @@ void InstrumentFunctionPass::addVersioningAndConflictDetection(Function *F){
           if(Callee == Malloc) continue;
         }
       }
-      Builder.SetInsertPoint(Store);
-      Value* ValueOp = Store->getValueOperand();
-      
-      Args.insert(Args.end(), {
-          Store->getPointerOperand(), 
-          ConstantInt::get(I64Ty, Layout.getTypeAllocSize(ValueOp->getType()))
-      });
-
-      Builder.CreateCall(GetShadowPtr, Args);
+      if(isPrivateOrReadOnly(F, Store, TopLevel)){
+        NumPrivateAccesses++;
+        continue;
+      }
+      Accesses.push_back(Store);
     } else if(auto *Load = dyn_cast<LoadInst>(&*I)) {
       if(GeneratedF){
         if(Load->getPointerOperand() == Ptr) continue;
@@ -127,22 +204,435 @@ void InstrumentFunctionPass::addVersioningAndConflictDetection(Function *F){
           if(Deref->getPointerOperand() == Ptr) continue;
         }
       }
-      Builder.SetInsertPoint(Load);
+      if(isPrivateOrReadOnly(F, Load, TopLevel)){
+        NumPrivateAccesses++;
+        continue;
+      }
+      Accesses.push_back(Load);
+    }
+  } 
 
-      Args.insert(Args.end(), {
-          Load->getPointerOperand()
-      });
+  std::map<Instruction *, Value *> Ranged;
+  if(EnableRangeChecks) addRangeChecks(F, Accesses, Ranged);
+
+  std::map<CallInst *, Instruction *> Checks;
 
-      Builder.CreateCall(CheckLoadConflict, Args);
+  for(Instruction *I : Accesses){
+    bool IsStore = isa<StoreInst>(I);
+    Function *Check = IsStore ? GetShadowPtr : CheckLoadConflict;
+    unsigned PtrIndex = IsStore ? StoreInst::getPointerOperandIndex() : LoadInst::getPointerOperandIndex();
+    Value *AccessPtr = getLoadStorePointerOperand(I);
+
+    Args.insert(Args.end(), {
+        AccessPtr, 
+        ConstantInt::get(I64Ty, Layout.getTypeAllocSize(getLoadStoreType(I)))
+    });
+
+    auto It = Ranged.find(I);
+    if(It == Ranged.end()){
+      Builder.SetInsertPoint(I);
+      CallInst *NewPtr = Builder.CreateCall(Check, Args);
+      I->setOperand(PtrIndex, NewPtr);
+      Checks[NewPtr] = I;
+      Args.clear();
+      continue;
     }
+
+    // Only checked here if the runtime couldn't check the whole range
+    BasicBlock *Head = I->getParent();
+    Builder.SetInsertPoint(I);
+    Instruction *Then = SplitBlockAndInsertIfThen(Builder.CreateNot(It->second), I, false);
+
+    Builder.SetInsertPoint(Then);
+    CallInst *Checked = Builder.CreateCall(Check, Args);
+    Checks[Checked] = I;
+
+    Builder.SetInsertPoint(I);
+    PHINode *NewPtr = Builder.CreatePHI(PtrTy, 2);
+    NewPtr->addIncoming(AccessPtr, Head);
+    NewPtr->addIncoming(Checked, Then->getParent());
+    I->setOperand(PtrIndex, NewPtr);
     Args.clear();
-  } 
+  }
+
+  if(EnableCheckElimination) removeRedundantChecks(F, Checks);
+  if(InlineShadowChecks) addInlineChecks(F, Checks);
+}
+
+void InstrumentFunctionPass::addRangeChecks(Function *F, 
+    std::vector<Instruction *> &Accesses, 
+    std::map<Instruction *, Value *> &Ranged){
+  Module *M = F->getParent();
+  const DataLayout &Layout = M->getDataLayout();
+
+  Type *PtrTy = PointerType::getUnqual(M->getContext());
+  Type *I64Ty = IntegerType::getInt64Ty(M->getContext());
+
+  Function *CheckReadRange = M->getFunction("__check_read_range");
+  Function *CheckWriteRange = M->getFunction("__check_write_range");
+
+  // bool (void *base, int64_t stride, int64_t count, int64_t size)
+  std::vector<Type *> ArgTy = {PtrTy, I64Ty, I64Ty, I64Ty};
+  FunctionType *FuncType = FunctionType::get(Type::getInt1Ty(M->getContext()), ArgTy, false);
+
+  if(!CheckReadRange){
+    CheckReadRange = Function::Create(FuncType, GlobalValue::ExternalLinkage, "__check_read_range", M);
+  }
+
+  if(!CheckWriteRange){
+    CheckWriteRange = Function::Create(FuncType, GlobalValue::ExternalLinkage, "__check_write_range", M);
+  }
+
+  LoopInfo &LI = FAM->getResult<LoopAnalysis>(*F);
+  ScalarEvolution &SE = FAM->getResult<ScalarEvolutionAnalysis>(*F);
+  DominatorTree &DT = FAM->getResult<DominatorTreeAnalysis>(*F);
+
+  SCEVExpander Expander(SE, Layout, "range");
+  IRBuilder<> Builder(F->getContext());
+
+  for(Instruction *I : Accesses){
+    Loop *L = LI.getLoopFor(I->getParent());
+    if(!L || !L->isInnermost()) continue;
+
+    // The access has to be made on every iteration, with the loop only
+    // leaving from its latch, for the range to be exactly what it touches
+    BasicBlock *Preheader = L->getLoopPreheader();
+    BasicBlock *Latch = L->getLoopLatch();
+    if(!Preheader || !Latch || L->getExitingBlock() != Latch) continue;
+    if(!DT.dominates(I->getParent(), Latch)) continue;
+
+    const SCEV *BackedgeCount = SE.getBackedgeTakenCount(L);
+    if(isa<SCEVCouldNotCompute>(BackedgeCount)) continue;
+
+    auto *AddRec = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(getLoadStorePointerOperand(I)));
+    if(!AddRec || AddRec->getLoop() != L || !AddRec->isAffine()) continue;
+
+    auto *Stride = dyn_cast<SCEVConstant>(AddRec->getStepRecurrence(SE));
+    if(!Stride) continue;
+
+    const SCEV *TripCount = SE.getAddExpr(SE.getTruncateOrZeroExtend(BackedgeCount, I64Ty), SE.getOne(I64Ty));
+    Instruction *InsertPt = Preheader->getTerminator();
+    if(!Expander.isSafeToExpandAt(AddRec->getStart(), InsertPt) || !Expander.isSafeToExpandAt(TripCount, InsertPt)) continue;
+
+    Value *Base = Expander.expandCodeFor(AddRec->getStart(), PtrTy, InsertPt);
+    Value *Count = Expander.expandCodeFor(TripCount, I64Ty, InsertPt);
+
+    std::vector<Value *> Args = {
+      Base,
+      ConstantInt::get(I64Ty, Stride->getAPInt().getSExtValue()),
+      Count,
+      ConstantInt::get(I64Ty, Layout.getTypeAllocSize(getLoadStoreType(I)))
+    };
+
+    Builder.SetInsertPoint(InsertPt);
+    Ranged[I] = Builder.CreateCall(isa<StoreInst>(I) ? CheckWriteRange : CheckReadRange, Args);
+    NumRangeChecks++;
+
+    LLVM_DEBUG(dbgs() << "range check for" << *I << " in " << F->getName() << "\n");
+  }
+}
+
+// With lazy versioning a check returns a pointer into the task's redo log,
+// which only stays valid across other checks if the access can't straddle a
+// cache line
+static bool fitsInLine(Instruction *I, uint64_t Size){
+  return Size <= std::min<uint64_t>(getLoadStoreAlignment(I).value(), 64);
+}
+
+static uint64_t getCheckSize(CallInst *Check){
+  return cast<ConstantInt>(Check->getArgOperand(1))->getZExtValue();
+}
+
+void InstrumentFunctionPass::removeRedundantChecks(Function *F, 
+    std::map<CallInst *, Instruction *> &Checks){
+  Module *M = F->getParent();
+  Function *CheckStore = M->getFunction("__check_write_conflict");
+  Function *CheckReadRange = M->getFunction("__check_read_range");
+  Function *CheckWriteRange = M->getFunction("__check_write_range");
+
+  // Same signature as the checks they replace
+  FunctionType *CheckTy = CheckStore->getFunctionType();
+  Function *CheckLoadAhead = M->getFunction("__check_load_ahead");
+  Function *CheckStoreAhead = M->getFunction("__check_write_ahead");
+  if(!CheckLoadAhead){
+    CheckLoadAhead = Function::Create(CheckTy, GlobalValue::ExternalLinkage, "__check_load_ahead", M);
+  }
+
+  if(!CheckStoreAhead){
+    CheckStoreAhead = Function::Create(CheckTy, GlobalValue::ExternalLinkage, "__check_write_ahead", M);
+  }
+
+  // The range checks split blocks
+  FAM->invalidate(*F, PreservedAnalyses::none());
+  LoopInfo &LI = FAM->getResult<LoopAnalysis>(*F);
+  DominatorTree &DT = FAM->getResult<DominatorTreeAnalysis>(*F);
+  AAResults &AA = FAM->getResult<AAManager>(*F);
+
+  auto getLocation = [](CallInst *Check){
+    return MemoryLocation(Check->getArgOperand(0), LocationSize::precise(getCheckSize(Check)));
+  };
+
+  // True if I can't be moved across Check: a load check is only affected by
+  // stores to the same memory, while a store check has to stay after any
+  // access to it, or loads of it would be taken for the task's own writes
+  auto interferes = [&](CallInst *Check, Instruction *I){
+    auto *Call = dyn_cast<CallBase>(I);
+    if(!Call || Call == Check) return false;
+
+    bool IsStore = Check->getCalledFunction() == CheckStore;
+    Function *Callee = Call->getCalledFunction();
+    if(Callee == CheckReadRange || Callee == CheckWriteRange) return false;
+
+    auto It = Checks.find(dyn_cast<CallInst>(Call));
+    if(It != Checks.end()){
+      if(!IsStore && Callee != CheckStore) return false;
+      return !AA.isNoAlias(getLocation(Check), getLocation(It->first));
+    }
+
+    return IsStore ? Call->mayReadOrWriteMemory() : Call->mayWriteToMemory();
+  };
+
+  // Checks in an order where each comes after the ones dominating it
+  ReversePostOrderTraversal<Function *> RPOT(F);
+  auto getOrdered = [&](){
+    std::vector<CallInst *> Ordered;
+    for(BasicBlock *BB : RPOT){
+      for(Instruction &I : *BB){
+        auto *Call = dyn_cast<CallInst>(&I);
+        auto It = Checks.find(Call);
+        if(It != Checks.end() && fitsInLine(It->second, getCheckSize(Call))) Ordered.push_back(Call);
+      }
+    }
+    return Ordered;
+  };
+
+  // An invariant pointer only has to be checked once, before the loop, if
+  // the check runs on the first iteration however the loop is left
+  auto canHoist = [&](CallInst *Check, Loop *L){
+    BasicBlock *Latch = L->getLoopLatch();
+    if(!L->getLoopPreheader() || !Latch || !L->isLoopInvariant(Check->getArgOperand(0))) return false;
+    if(!DT.dominates(Check->getParent(), Latch)) return false;
+
+    for(BasicBlock *BB : L->blocks()){
+      if((L->isLoopExiting(BB) || succ_empty(BB)) && !DT.dominates(Check->getParent(), BB)) return false;
+      for(Instruction &I : *BB){
+        if(interferes(Check, &I)) return false;
+      }
+    }
+    return true;
+  };
+
+  // Checks that now stand for accesses made after them, which another task
+  // may touch in between
+  std::set<CallInst *> Ahead;
+
+  for(CallInst *Check : getOrdered()){
+    bool Hoisted = false;
+    for(Loop *L = LI.getLoopFor(Check->getParent()); L && canHoist(Check, L); L = L->getParentLoop()){
+      Check->moveBefore(L->getLoopPreheader()->getTerminator());
+      Hoisted = true;
+    }
+
+    if(Hoisted){
+      Ahead.insert(Check);
+      NumHoistedChecks++;
+      LLVM_DEBUG(dbgs() << "hoisted" << *Check << " in " << F->getName() << "\n");
+    }
+  }
+
+  // Checks of the same pointer, size and kind that were kept
+  std::map<std::tuple<Function *, Value *, uint64_t>, std::vector<CallInst *>> Kept;
+  for(CallInst *Check : getOrdered()){
+    std::vector<CallInst *> &Same = Kept[{Check->getCalledFunction(), Check->getArgOperand(0), getCheckSize(Check)}];
+    bool IsStore = Check->getCalledFunction() == CheckStore;
+
+    CallInst *Dominating = nullptr;
+    for(CallInst *Earlier : Same){
+      if(!DT.dominates(Earlier, Check)) continue;
+
+      // A store check leaves the task owning the memory, but a load check
+      // has to be made again after a store to it
+      bool Clobbered = !IsStore && any_of(instructions(F), [&](Instruction &I){
+        return interferes(Earlier, &I) && 
+            isPotentiallyReachable(Earlier, &I, nullptr, &DT, &LI) && 
+            isPotentiallyReachable(&I, Check, nullptr, &DT, &LI);
+      });
+
+      if(!Clobbered){
+        Dominating = Earlier;
+        break;
+      }
+    }
+
+    if(!Dominating){
+      Same.push_back(Check);
+      continue;
+    }
+
+    LLVM_DEBUG(dbgs() << "removed" << *Check << " in " << F->getName() << "\n");
+    Check->replaceAllUsesWith(Dominating);
+    Ahead.insert(Dominating);
+    Ahead.erase(Check);
+    Checks.erase(Check);
+    Check->eraseFromParent();
+    NumRedundantChecks++;
+  }
+
+  // With eager versioning, the runtime only finds a conflict when the later
+  // task's access is checked second, so these are checked again when the
+  // iteration ends
+  for(CallInst *Check : Ahead){
+    Check->setCalledFunction(Check->getCalledFunction() == CheckStore ? CheckStoreAhead : CheckLoadAhead);
+  }
+}
+
+// Matches ShadowLayout, ShadowCell and the slot encoding in threadlib's
+// ShadowMemory.h
+static constexpr uint64_t ShadowRegionShift = 32;
+static constexpr uint64_t ShadowAddrBits = 47;
+static constexpr uint64_t ShadowCellChunkShift = 16;
+static constexpr uint64_t ShadowSavedOffset = 16;
+static constexpr uint64_t ShadowWriterOffset = 24;
+static constexpr uint64_t ShadowReaderOffset = 32;
+
+void InstrumentFunctionPass::addInlineChecks(Function *F, 
+    std::map<CallInst *, Instruction *> &Checks){
+  Module *M = F->getParent();
+  LLVMContext &Context = M->getContext();
+  Function *CheckStore = M->getFunction("__check_write_conflict");
+  Function *CheckLoad = M->getFunction("__check_load_conflict");
+
+  Type *PtrTy = PointerType::getUnqual(Context);
+  Type *I8Ty = IntegerType::getInt8Ty(Context);
+  Type *I32Ty = IntegerType::getInt32Ty(Context);
+  Type *I64Ty = IntegerType::getInt64Ty(Context);
+
+  // { regions, chunks, generation, granule shift, cell size }
+  StructType *LayoutTy = StructType::get(Context, {PtrTy, PtrTy, I32Ty, I32Ty, I32Ty});
+  auto *Layout = cast<GlobalVariable>(M->getOrInsertGlobal("__threadlib_shadow", LayoutTy));
+
+  // { owner, iteration }, set by the worker for the task it runs
+  StructType *TaskTy = StructType::get(Context, {PtrTy, I64Ty});
+  auto *InlineTask = cast<GlobalVariable>(M->getOrInsertGlobal("__threadlib_task", TaskTy));
+  InlineTask->setThreadLocalMode(GlobalValue::InitialExecTLSModel);
+
+  IRBuilder<> Builder(Context);
+
+  auto loadAtomic = [&](Type *Ty, Value *Addr, AtomicOrdering Ordering){
+    LoadInst *Load = Builder.CreateLoad(Ty, Addr);
+    Load->setAtomic(Ordering);
+    Load->setAlignment(M->getDataLayout().getABITypeAlign(Ty));
+    return Load;
+  };
+
+  // Collected first, as the blocks are split below. Checks made ahead of
+  // later accesses have to reach the runtime, which checks them again
+  std::vector<CallInst *> Calls;
+  for(Instruction &I : instructions(F)){
+    auto *Call = dyn_cast<CallInst>(&I);
+    if(!Call || Checks.find(Call) == Checks.end()) continue;
+    if(Call->getCalledFunction() == CheckStore || Call->getCalledFunction() == CheckLoad) Calls.push_back(Call);
+  }
+
+  for(CallInst *Check : Calls){
+    bool IsStore = Check->getCalledFunction() == CheckStore;
+    Value *Ptr = Check->getArgOperand(0);
+    uint64_t Size = cast<ConstantInt>(Check->getArgOperand(1))->getZExtValue();
+    if(!Size) continue;
+
+    // Only the runtime can check accesses spanning several granules, and
+    // the saved bytes of a store are only kept for granules of up to 64
+    // bytes
+    Builder.SetInsertPoint(Check);
+    Value *Owner = Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(TaskTy, InlineTask, 0));
+    Value *Shift = Builder.CreateZExt(Builder.CreateLoad(I32Ty, Builder.CreateStructGEP(LayoutTy, Layout, 3)), I64Ty);
+    Value *Addr = Builder.CreatePtrToInt(Ptr, I64Ty);
+    Value *Last = Builder.CreateAdd(Addr, ConstantInt::get(I64Ty, Size - 1));
+
+    Value *Usable = Builder.CreateAnd({
+      Builder.CreateIsNotNull(Owner),
+      Builder.CreateICmpEQ(Builder.CreateLShr(Addr, Shift), Builder.CreateLShr(Last, Shift)),
+      Builder.CreateIsNull(Builder.CreateLShr(Addr, ShadowAddrBits))
+    });
+    if(IsStore) Usable = Builder.CreateAnd(Usable, Builder.CreateICmpULE(Shift, ConstantInt::get(I64Ty, 6)));
+
+    BasicBlock *Head = Check->getParent();
+    BasicBlock *Cont = SplitBlock(Head, Check->getNextNode());
+    BasicBlock *Slow = SplitBlock(Head, Check);
+    BasicBlock *Region = BasicBlock::Create(Context, "shadow.region", F, Slow);
+    BasicBlock *SlotBB = BasicBlock::Create(Context, "shadow.slot", F, Slow);
+    BasicBlock *Cell = BasicBlock::Create(Context, "shadow.cell", F, Slow);
+
+    Head->getTerminator()->eraseFromParent();
+    Builder.SetInsertPoint(Head);
+    Builder.CreateCondBr(Usable, Region, Slow);
+
+    // Region of the shadow the granule's slot is in, mapped on first use
+    Builder.SetInsertPoint(Region);
+    Value *Regions = Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(LayoutTy, Layout, 0));
+    Value *RegionAddr = Builder.CreateGEP(PtrTy, Regions, Builder.CreateLShr(Addr, ShadowRegionShift));
+    Value *RegionBase = loadAtomic(PtrTy, RegionAddr, AtomicOrdering::Acquire);
+    Builder.CreateCondBr(Builder.CreateIsNotNull(RegionBase), SlotBB, Slow);
+
+    // The slot holds (generation << 32 | index of the newest cell), a slot
+    // from an older generation is empty
+    Builder.SetInsertPoint(SlotBB);
+    Value *Offset = Builder.CreateLShr(Builder.CreateAnd(Addr, (1ull << ShadowRegionShift) - 1), Shift);
+    Value *Slot = loadAtomic(I64Ty, Builder.CreateGEP(I64Ty, RegionBase, Offset), AtomicOrdering::Acquire);
+    Value *Generation = Builder.CreateZExt(Builder.CreateLoad(I32Ty, Builder.CreateStructGEP(LayoutTy, Layout, 2)), I64Ty);
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Builder.CreateLShr(Slot, 32), Generation), Cell, Slow);
+
+    Builder.SetInsertPoint(Cell);
+    Value *Index = Builder.CreateAnd(Slot, 0xffffffff);
+    Value *Chunks = Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(LayoutTy, Layout, 1));
+    Value *Chunk = loadAtomic(PtrTy, Builder.CreateGEP(PtrTy, Chunks, Builder.CreateLShr(Index, ShadowCellChunkShift)), AtomicOrdering::Acquire);
+    Value *CellSize = Builder.CreateZExt(Builder.CreateLoad(I32Ty, Builder.CreateStructGEP(LayoutTy, Layout, 4)), I64Ty);
+    Value *CellAddr = Builder.CreateGEP(I8Ty, Chunk, 
+        Builder.CreateMul(Builder.CreateAnd(Index, (1ull << ShadowCellChunkShift) - 1), CellSize));
+
+    Value *Iteration = Builder.CreateLoad(I64Ty, Builder.CreateStructGEP(TaskTy, InlineTask, 1));
+    Value *CellOwner = Builder.CreateLoad(PtrTy, CellAddr);
+    Value *LastWrite = loadAtomic(I64Ty, Builder.CreateConstGEP1_64(I8Ty, CellAddr, ShadowWriterOffset), AtomicOrdering::SequentiallyConsistent);
+    Value *LastRead = loadAtomic(I64Ty, Builder.CreateConstGEP1_64(I8Ty, CellAddr, ShadowReaderOffset), AtomicOrdering::SequentiallyConsistent);
+
+    // Nothing would change if the runtime checked the access again: this
+    // iteration is the latest to have made it and no later one has touched
+    // the granule. A store also needs its bytes to be saved already
+    Value *Own = Builder.CreateICmpEQ(CellOwner, Owner);
+    Value *Hit;
+    if(IsStore){
+      Value *Saved = loadAtomic(I64Ty, Builder.CreateConstGEP1_64(I8Ty, CellAddr, ShadowSavedOffset), AtomicOrdering::Monotonic);
+      Value *InGranule = Builder.CreateAnd(Addr, Builder.CreateSub(Builder.CreateShl(ConstantInt::get(I64Ty, 1), Shift), ConstantInt::get(I64Ty, 1)));
+      Value *Bytes = Builder.CreateShl(ConstantInt::get(I64Ty, Size >= 64 ? ~0ull : (1ull << Size) - 1), InGranule);
+
+      Hit = Builder.CreateAnd({Own, 
+          Builder.CreateICmpEQ(LastWrite, Iteration),
+          Builder.CreateOr(Builder.CreateIsNull(LastRead), Builder.CreateICmpEQ(LastRead, Iteration)),
+          Builder.CreateICmpEQ(Builder.CreateAnd(Saved, Bytes), Bytes)});
+    } else {
+      Hit = Builder.CreateAnd({Own, 
+          Builder.CreateICmpEQ(LastRead, Iteration),
+          Builder.CreateOr(Builder.CreateIsNull(LastWrite), Builder.CreateICmpEQ(LastWrite, Iteration))});
+    }
+    Builder.CreateCondBr(Hit, Cont, Slow);
+
+    // The inline owner is only set with eager versioning, so the access
+    // goes to Ptr itself
+    Builder.SetInsertPoint(&Cont->front());
+    PHINode *Result = Builder.CreatePHI(PtrTy, 2);
+    Check->replaceAllUsesWith(Result);
+    Result->addIncoming(Ptr, Cell);
+    Result->addIncoming(Check, Slow);
+    NumInlineChecks++;
+  }
 }
 
 PreservedAnalyses InstrumentFunctionPass::run(Module &M, ModuleAnalysisManager &AM){
   NamedMDNode *NMD = M.getNamedMetadata("GeneratedFunctions");
   if(!NMD) return PreservedAnalyses::all();
 
+  FAM = &AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
   for(MDNode *Op : NMD->operands()){
     auto *FName = cast<MDString>(Op->getOperand(0));
     Function *F = M.getFunction(FName->getString());
@@ -150,10 +640,18 @@ PreservedAnalyses InstrumentFunctionPass::run(Module &M, ModuleAnalysisManager &
       continue;
     }
     Generated.insert(F);
+
+    if(Op->getNumOperands() > 1 && cast<MDString>(Op->getOperand(1))->getString() == "parallel") Parallel.insert(F);
   }
   
   LLVM_DEBUG(dbgs() << "Number of generated functions: " << Generated.size() << "\n");
   for(Function *F : Generated){
+    // Enqueued with __enqueue_parallel_task, which runs them unchecked. A
+    // nested one can still conflict with the enclosing loop
+    if(Parallel.find(F) != Parallel.end() && !isNested(F)){
+      NumParallelBodies++;
+      continue;
+    }
     instrumentFunction(F); 
   }
 
@@ -7,10 +7,14 @@
 #include <set>
 #include <stack>
 #include <map>
+#include <vector>
 
 namespace llvm{
+class CallInst;
 class Function;
+class Instruction;
 class Module;
+class Value;
 
 class InstrumentFunctionPass : public PassInfoMixin<InstrumentFunctionPass>{
 
@@ -21,6 +25,11 @@ protected:
   std::set<Function *> Generated;
   std::set<Function *> Instrumented;
 
+  // Loop bodies proven to have independent iterations
+  std::set<Function *> Parallel;
+
+  FunctionAnalysisManager *FAM;
+
 public:
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
 
@@ -28,6 +37,39 @@ protected:
   void collectCalledFunctions(Function *F);
   void instrumentFunction(Function *F);
   void addVersioningAndConflictDetection(Function *F);
+
+  // True if F is the body of a loop nested in another extracted loop, whose
+  // iterations can run alongside the enclosing loop's
+  bool isNested(Function *F);
+
+  // True if F, or a function it calls, may enqueue a loop, which runs
+  // nested in the loop F is the body of
+  bool startsLoops(Function *F, std::set<Function *> &Visited);
+
+  // True if I only touches memory no other task can access or that no task
+  // writes: allocas that don't escape, constants, and in the body of a
+  // top-level loop that starts no nested loops, memory nothing in the body
+  // may write
+  bool isPrivateOrReadOnly(Function *F, Instruction *I, bool TopLevel);
+
+  // Checks the strided accesses of inner loops once per loop, in the
+  // preheader. Returns, for each access covered, the flag that is false
+  // when the access still has to be checked on its own
+  void addRangeChecks(Function *F, 
+      std::vector<Instruction *> &Accesses, 
+      std::map<Instruction *, Value *> &Ranged);
+
+  // Moves checks of loop-invariant pointers out of inner loops and drops
+  // checks dominated by a check of the same pointer and kind. The checks
+  // left standing for later accesses call the __check_*_ahead variants.
+  // Checks maps each check to the access it was made for
+  void removeRedundantChecks(Function *F, 
+      std::map<CallInst *, Instruction *> &Checks);
+
+  // Puts a lookup of the shadow cell in front of each check, which skips
+  // the call when the running task already made the same access
+  void addInlineChecks(Function *F, 
+      std::map<CallInst *, Instruction *> &Checks);
 };
 }
 #endif
@@ -3,6 +3,7 @@
 #include <iostream>
 
 #include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Dominators.h"
@@ -16,6 +17,8 @@
 #include "llvm/Transforms/Utils/LoopSimplify.h"
 #include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 
@@ -28,9 +31,17 @@ using namespace llvm;
 
 std::set<Function *> LoopExtractionPass::GeneratedFunctions;
 std::set<Function *> LoopExtractionPass::PreservedFunctions;
+std::map<std::string, LoopProfile> LoopExtractionPass::Profile;
+bool LoopExtractionPass::ProfileLoaded = false;
 
 static llvm::cl::opt<bool> EnableExtraction("enable-extract-loop-bodies", llvm::cl::desc("Enable loop extraction"));
 
+static llvm::cl::opt<std::string> ProfileFile("loop-extraction-profile", 
+    llvm::cl::desc("Loop statistics written by threadlib with THREADLIB_PROFILE"));
+
+static llvm::cl::opt<double> MinSpeedup("loop-extraction-min-speedup", llvm::cl::init(1.0),
+    llvm::cl::desc("Don't extract profiled loops that ran slower than this over their tasks run one by one"));
+
 void LoopExtractionPass::verifyBody(Function *F){
   std::string errorMessage; 
   raw_string_ostream errorStream(errorMessage); 
@@ -42,7 +53,7 @@ void LoopExtractionPass::verifyBody(Function *F){
   } 
 }
 
-void LoopExtractionPass::addGenerated(Function *F){
+void LoopExtractionPass::addGenerated(Function *F, StringRef Kind){
   GeneratedFunctions.insert(F);
   Module *M = F->getParent();
   StringRef FName = F->getName();
@@ -51,17 +62,132 @@ void LoopExtractionPass::addGenerated(Function *F){
   
   NamedMDNode *NMD = M->getOrInsertNamedMetadata("GeneratedFunctions");
 
-  Metadata *MDStr = MDString::get(Context, FName); 
-  MDNode *MDN = MDNode::get(Context, MDStr);
+  std::vector<Metadata *> Ops = {MDString::get(Context, FName)};
+  if(!Kind.empty()) Ops.push_back(MDString::get(Context, Kind));
+
+  MDNode *MDN = MDNode::get(Context, Ops);
   NMD->addOperand(MDN);
 }
 
+void LoopExtractionPass::loadProfile(){
+  ProfileLoaded = true;
+  if(ProfileFile.empty()) return;
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFile(ProfileFile);
+  if(!Buffer){
+    errs() << "Can't read loop profile " << ProfileFile << ": " << Buffer.getError().message() << "\n";
+    return;
+  }
+
+  // <symbol> <runs> <conflicts> <iterations> <committed ns> <wasted ns> <busy ns> <checks>
+  for(line_iterator Line(**Buffer); !Line.is_at_eof(); Line++){
+    SmallVector<StringRef, 8> Fields;
+    Line->split(Fields, ' ', -1, false);
+    if(Fields.size() != 8) continue;
+
+    LoopProfile Entry;
+    uint64_t *Counters[] = {&Entry.Runs, &Entry.Conflicts, &Entry.Iterations, 
+      &Entry.CommittedTime, &Entry.WastedTime, &Entry.BusyTime, &Entry.Checks};
+
+    bool Valid = true;
+    for(unsigned i = 0; i < 7; i++){
+      Valid &= !Fields[i + 1].getAsInteger(10, *Counters[i]);
+    }
+
+    if(Valid) Profile[Fields[0].str()] = Entry;
+  }
+}
+
+bool LoopExtractionPass::isProfitable(StringRef Name){
+  if(!ProfileLoaded) loadProfile();
+
+  auto It = Profile.find(Name.str());
+  if(It == Profile.end() || !It->second.Runs) return true;
+
+  const LoopProfile &Entry = It->second;
+  if(Entry.Conflicts == Entry.Runs){
+    std::cout << "SKIPPING: ALWAYS CONFLICTED\n";
+    return false;
+  }
+
+  // Busy time over wall time of the committed runs
+  if(Entry.CommittedTime && (double)Entry.BusyTime < MinSpeedup * Entry.CommittedTime){
+    std::cout << "SKIPPING: NO SPEEDUP\n";
+    return false;
+  }
+
+  LLVM_DEBUG(dbgs() << Name << ": " << Entry.Runs << " runs, " << Entry.Conflicts << " conflicts, " 
+      << (Entry.Iterations ? Entry.Checks / Entry.Iterations : 0) << " checks per iteration\n");
+  return true;
+}
+
 void LoopExtractionPass::trySimplifyLoops(){
   for(Loop *L : *LI) {
     simplifyLoop(L, DT, LI, SE, nullptr, nullptr, false);
   }
 }
 
+LoopDependence LoopExtractionPass::classifyLoop(const Loop *L, PHINode *IndVar){
+  unsigned Level = L->getLoopDepth();
+  BasicBlock *Latch = L->getLoopLatch();
+  bool Unknown = false;
+
+  // Other values carried between iterations and values used after the loop
+  // are kept in memory by the extracted body, where only speculation can
+  // tell whether iterations overwrite each other's
+  for(PHINode &Phi : L->getHeader()->phis()){
+    if(&Phi != IndVar) Unknown = true;
+  }
+
+  std::vector<Instruction *> Accesses;
+  for(BasicBlock *BB : L->blocks()){
+    for(Instruction &I : *BB){
+      for(User *U : I.users()){
+        if(!L->contains(cast<Instruction>(U))) Unknown = true;
+      }
+
+      if(auto *Call = dyn_cast<CallBase>(&I)){
+        if(isa<DbgInfoIntrinsic>(Call) || Call->isLifetimeStartOrEnd()) continue;
+        if(Call->mayReadOrWriteMemory() || Call->mayHaveSideEffects()) Unknown = true;
+        continue;
+      }
+
+      if(!I.mayReadOrWriteMemory()) continue;
+      if(auto *Load = dyn_cast<LoadInst>(&I); Load && Load->isSimple()) Accesses.push_back(Load);
+      else if(auto *Store = dyn_cast<StoreInst>(&I); Store && Store->isSimple()) Accesses.push_back(Store);
+      else Unknown = true;
+    }
+  }
+
+  // A store read back a fixed number of iterations later on every iteration
+  // conflicts whenever those iterations run on different workers
+  auto isCarriedFlow = [&](Dependence &D){
+    auto *Distance = dyn_cast_or_null<SCEVConstant>(D.getDistance(Level));
+    if(!D.isFlow() || !D.isConsistent() || !Distance || !Distance->getAPInt().isStrictlyPositive()) return false;
+
+    for(Instruction *I : {D.getSrc(), D.getDst()}){
+      if(LI->getLoopFor(I->getParent()) != L || !DT->dominates(I->getParent(), Latch)) return false;
+    }
+
+    uint64_t Iterations = Distance->getAPInt().getLimitedValue();
+    return Iterations == 1 || SE->getSmallConstantTripCount(L) > Iterations;
+  };
+
+  for(size_t i = 0; i < Accesses.size(); i++){
+    for(size_t j = i; j < Accesses.size(); j++){
+      if(!isa<StoreInst>(Accesses[i]) && !isa<StoreInst>(Accesses[j])) continue;
+
+      std::unique_ptr<Dependence> D = DI->depends(Accesses[i], Accesses[j], true);
+      if(!D) continue;
+      if(isCarriedFlow(*D)) return LoopDependence::Dependent;
+
+      if(D->isConfused() || (D->getDirection(Level) & (Dependence::DVEntry::LT | Dependence::DVEntry::GT))) Unknown = true;
+    }
+  }
+
+  return Unknown ? LoopDependence::Unknown : LoopDependence::Parallel;
+}
+
 void LoopExtractionPass::findPHINodesForLoop(const Loop *L, 
     PHINode *IndVar,
     std::vector<Value *> &ExternalUses){
@@ -425,10 +551,12 @@ void LoopExtractionPass::enqueueTask(Function *OriginalF,
     Value *RestOfFunc, 
     Loop::LoopBounds &Bounds, 
     Value *StoreAddr,
-    Value *NewScopeAddr){
+    Value *NewScopeAddr,
+    bool Parallel){
 
   Module *M = OriginalF->getParent();
-  Function *EnqueueTask = M->getFunction("__enqueue_task");
+  StringRef EnqueueName = Parallel ? "__enqueue_parallel_task" : "__enqueue_task";
+  Function *EnqueueTask = M->getFunction(EnqueueName);
   
   IRBuilder<> Builder(OriginalF->getContext());
   
@@ -439,7 +567,7 @@ void LoopExtractionPass::enqueueTask(Function *OriginalF,
     std::vector<Type *> EnqueueArgTy = {PtrTy, PtrTy, PtrTy, PtrTy, PtrTy, I64Ty, I64Ty, I64Ty};
  
     FunctionType *FuncType = FunctionType::get(Type::getInt1Ty(M->getContext()), EnqueueArgTy, false);
-    EnqueueTask = Function::Create(FuncType, GlobalValue::ExternalLinkage, "__enqueue_task", M);
+    EnqueueTask = Function::Create(FuncType, GlobalValue::ExternalLinkage, EnqueueName, M);
   }
 
   assert(EnqueueTask && "EnqueueTask is null");
@@ -703,7 +831,7 @@ Value *LoopExtractionPass::createNestedScope(Function *GeneratedF,
   return NewScope;
 }
 
-void LoopExtractionPass::cloneLoopAndRemap(Function &F, const Loop *L){
+void LoopExtractionPass::cloneLoopAndRemap(Function &F, const Loop *L, unsigned Index){
   LLVM_DEBUG(dbgs() << "Extracting loop body found in " << F.getName() << "\n");
   Module *M = F.getParent();
 
@@ -745,6 +873,25 @@ void LoopExtractionPass::cloneLoopAndRemap(Function &F, const Loop *L){
     return;
   }
 
+  // Numbered by the loop's position in F rather than left for LLVM to make
+  // unique, so a loop keeps its name in the profile when an earlier one
+  // isn't extracted
+  std::string BodyName = (F.getName() + "ParallelLoopBody").str();
+  if(Index) BodyName += "." + std::to_string(Index);
+
+  // The runtime only profiles top-level loops
+  if(!isGenerated(&F) && !isProfitable(BodyName)) return;
+
+  LoopDependence Kind = classifyLoop(L, IndVar);
+  if(Kind == LoopDependence::Dependent){
+    std::cout << "SKIPPING: LOOP-CARRIED DEPENDENCE\n";
+    return;
+  }
+
+  // Nested loops are still checked, their iterations can conflict with the
+  // enclosing loop's
+  bool Parallel = Kind == LoopDependence::Parallel && !isGenerated(&F);
+
   std::vector<BasicBlock *> LoopBlocks = L->getBlocks();
 
   std::map<BasicBlock *, BasicBlock *> BMap;
@@ -757,7 +904,7 @@ void LoopExtractionPass::cloneLoopAndRemap(Function &F, const Loop *L){
   std::vector<Type *> FuncTypes = {IndVar->getType(), PtrTy};
 
   FunctionType *FuncType = FunctionType::get(Type::getVoidTy(M->getContext()), FuncTypes, false);
-  Function *ExtractedBody = Function::Create(FuncType, GlobalValue::ExternalLinkage, F.getName() + "ParallelLoopBody", M);    
+  Function *ExtractedBody = Function::Create(FuncType, GlobalValue::ExternalLinkage, BodyName, M);    
  
   // Initialise Function pointers in case we are looking at a nested loop
   Value *SequentialBody = ConstantPointerNull::get(PtrTy);
@@ -857,11 +1004,12 @@ void LoopExtractionPass::cloneLoopAndRemap(Function &F, const Loop *L){
       RestOfFunc, 
       *BoundsOpt, 
       StoreAddr,
-      NewScope);
+      NewScope,
+      Parallel);
 
   verifyBody(ExtractedBody);
 
-  addGenerated(ExtractedBody);
+  addGenerated(ExtractedBody, Kind == LoopDependence::Parallel ? "parallel" : "unknown");
 }
 
 PreservedAnalyses LoopExtractionPass::run(Function &F, FunctionAnalysisManager &AM) {
@@ -881,9 +1029,11 @@ PreservedAnalyses LoopExtractionPass::run(Function &F, FunctionAnalysisManager &
 
   SE = &AM.getResult<ScalarEvolutionAnalysis>(F); 
   DT = &AM.getResult<DominatorTreeAnalysis>(F);
+  DI = &AM.getResult<DependenceAnalysis>(F);
 
   trySimplifyLoops();
 
+  unsigned Index = 0;
   for(const auto L: *LI){
     if(!L->isLoopSimplifyForm()){ 
       LLVM_DEBUG(dbgs() << "Non-simplified loop in " << F.getName() << ", skipping\n");
@@ -895,7 +1045,7 @@ PreservedAnalyses LoopExtractionPass::run(Function &F, FunctionAnalysisManager &
       continue;
     }
 
-    cloneLoopAndRemap(F, L);
+    cloneLoopAndRemap(F, L, Index++);
   }
 
   return PreservedAnalyses::none();
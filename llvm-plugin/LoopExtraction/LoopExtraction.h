@@ -2,29 +2,58 @@
 #define LLVM_ANALYSIS_LOOPEXTRACTION_H
 
 #include "llvm/IR/PassManager.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 
 #include <map>
 #include <set>
+#include <string>
 #include <vector>
 
 namespace llvm {
+// Totals the runtime wrote for one loop body with THREADLIB_PROFILE
+struct LoopProfile {
+  uint64_t Runs = 0;
+  uint64_t Conflicts = 0;
+  uint64_t Iterations = 0;
+  uint64_t CommittedTime = 0;
+  uint64_t WastedTime = 0;
+  uint64_t BusyTime = 0;
+  uint64_t Checks = 0;
+};
+
+// What dependence analysis could prove about the iterations of a loop.
+// Parallel loops run without instrumentation, dependent ones aren't
+// extracted and unknown ones are speculated
+enum class LoopDependence {
+  Parallel,
+  Dependent,
+  Unknown
+};
+
 class LoopExtractionPass : public PassInfoMixin<LoopExtractionPass>{
 public:
   static std::set<Function *> GeneratedFunctions;
   static std::set<Function *> PreservedFunctions;
 
+  // Read from -loop-extraction-profile the first time it's needed
+  static std::map<std::string, LoopProfile> Profile;
+  static bool ProfileLoaded;
+
 protected:
   FunctionAnalysisManager *FAM;
   LoopInfo *LI;
   ScalarEvolution *SE;
   DominatorTree *DT;
+  DependenceInfo *DI;
 
 public:
   static void verifyBody(Function *F);
 
-  static void addGenerated(Function *F);
+  // Kind is recorded next to the name in the GeneratedFunctions metadata,
+  // "parallel" or "unknown" for loop bodies as classifyLoop found them
+  static void addGenerated(Function *F, StringRef Kind = "");
 
   static bool isGenerated(Function *F){
     return GeneratedFunctions.find(F) != GeneratedFunctions.end();
@@ -34,10 +63,18 @@ public:
     return PreservedFunctions.find(F) != PreservedFunctions.end(); 
   }
 
+  static void loadProfile();
+
+  // False if the profile shows the loop whose body would be called Name
+  // always conflicted or never ran faster than its tasks did one by one
+  static bool isProfitable(StringRef Name);
+
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
 
 protected:
   void trySimplifyLoops();
+
+  LoopDependence classifyLoop(const Loop *L, PHINode *IndVar);
     
   void findPHINodesForLoop(const Loop *L, 
       PHINode *IndVar,
@@ -84,7 +121,8 @@ protected:
       Value *RestOfFunc, 
       Loop::LoopBounds &Bounds, 
       Value *StoreAddr,
-      Value *NewScopeAddr);
+      Value *NewScopeAddr,
+      bool Parallel);
 
   Value *createNestedScope(Function *GeneratedF, 
       Function *SeqExtractedBody, 
@@ -95,7 +133,7 @@ protected:
       BasicBlock *Exit,
       BasicBlock *Succ);
 
-  void cloneLoopAndRemap(Function &F, const Loop *L);
+  void cloneLoopAndRemap(Function &F, const Loop *L, unsigned Index);
 };
 }
 #endif
@@ -0,0 +1,80 @@
+// Scaling benchmark for the address history table. Each thread records
+// accesses to its own disjoint set of addresses, which is the common case for
+// a conflict-free loop, so any loss of throughput as threads are added comes
+// from contention inside the table itself.
+//
+// Usage: addr-table [max threads] [accesses per thread]
+
+#include "../src/AddrTable.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace threadlib;
+
+struct Entry {
+  uint64_t m_reads = 0;
+  uint64_t m_writes = 0;
+};
+
+// The original layout: one std::map behind one mutex
+class SingleLockTable {
+public:
+  template<class Fn>
+  auto access(void *addr, Fn &&fn){
+    std::scoped_lock lock(m_mutex);
+    return fn(m_map[addr]);
+  }
+
+protected:
+  std::mutex m_mutex;
+  std::map<void *, Entry> m_map;
+};
+
+template<class Table>
+double run(uint32_t numThreads, uint64_t accesses){
+  Table table;
+  std::vector<std::vector<uint64_t>> data(numThreads, std::vector<uint64_t>(4096));
+  std::vector<std::thread> threads;
+
+  auto start = std::chrono::steady_clock::now();
+  for(uint32_t t = 0; t < numThreads; t++){
+    threads.emplace_back([&, t](){
+      std::vector<uint64_t> &mine = data[t];
+      for(uint64_t i = 0; i < accesses; i++){
+        void *addr = &mine[i % mine.size()];
+        table.access(addr, [i](Entry &entry){
+          if(i & 1) entry.m_writes++;
+          else entry.m_reads++;
+          return 0;
+        });
+      }
+    });
+  }
+
+  for(std::thread &t : threads) t.join();
+  auto end = std::chrono::steady_clock::now();
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  return (double)(numThreads * accesses) / seconds / 1e6;
+}
+
+int main(int argc, char **argv){
+  uint32_t maxThreads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+  uint64_t accesses = argc > 2 ? atoll(argv[2]) : 1000000;
+  if(maxThreads == 0) maxThreads = 1;
+
+  printf("%8s %20s %20s\n", "threads", "single lock (Mop/s)", "sharded (Mop/s)");
+  for(uint32_t threads = 1; threads <= maxThreads; threads *= 2){
+    double single = run<SingleLockTable>(threads, accesses);
+    double sharded = run<AddrTable<Entry>>(threads, accesses);
+    printf("%8u %20.2f %20.2f\n", threads, single, sharded);
+  }
+
+  return 0;
+}
@@ -0,0 +1,96 @@
+// Scaling benchmark for the job task queue. The main thread queues every
+// iteration of a loop at once, as ThreadPool::addTask does, and the workers
+// then drain the queue running an empty task body, so the throughput is
+// bounded by the cost of enqueueing and dequeueing tasks.
+//
+// Usage: task-queue [max threads] [tasks]
+
+#include "../src/StealQueue.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+using namespace threadlib;
+
+using Item = uint64_t;
+using Newer = std::greater<Item>;
+
+// The original layout: one priority queue behind one mutex
+class SingleQueue {
+public:
+  SingleQueue(uint32_t){}
+
+  template<class It>
+  void push(It begin, It end){
+    for(It it = begin; it != end; it++){
+      std::scoped_lock lock(m_mutex);
+      m_items.push(*it);
+    }
+  }
+
+  bool pop(uint32_t, Item &item){
+    std::scoped_lock lock(m_mutex);
+    if(m_items.empty()) return false;
+
+    item = m_items.top();
+    m_items.pop();
+    return true;
+  }
+
+protected:
+  std::mutex m_mutex;
+  std::priority_queue<Item, std::vector<Item>, Newer> m_items;
+};
+
+template<class Queue>
+double run(uint32_t numThreads, uint64_t tasks){
+  Queue queue(numThreads);
+  std::vector<Item> items(tasks);
+  for(uint64_t i = 0; i < tasks; i++) items[i] = i;
+
+  std::vector<std::thread> threads;
+  std::vector<uint64_t> sums(numThreads * 8);
+
+  auto start = std::chrono::steady_clock::now();
+  queue.push(items.begin(), items.end());
+
+  for(uint32_t t = 0; t < numThreads; t++){
+    threads.emplace_back([&, t](){
+      Item item;
+      uint64_t sum = 0;
+      while(queue.pop(t, item)) sum += item;
+      sums[t * 8] = sum;
+    });
+  }
+
+  for(std::thread &t : threads) t.join();
+  auto end = std::chrono::steady_clock::now();
+
+  uint64_t total = 0;
+  for(uint64_t sum : sums) total += sum;
+  if(total != tasks * (tasks - 1) / 2) fprintf(stderr, "lost tasks with %u threads\n", numThreads);
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  return (double)tasks / seconds / 1e6;
+}
+
+int main(int argc, char **argv){
+  uint32_t maxThreads = argc > 1 ? atoi(argv[1]) : 64;
+  uint64_t tasks = argc > 2 ? atoll(argv[2]) : 1000000;
+  if(maxThreads == 0) maxThreads = 1;
+
+  printf("%8s %24s %24s\n", "threads", "single queue (Mtask/s)", "stealing (Mtask/s)");
+  for(uint32_t threads = 1; threads <= maxThreads; threads *= 2){
+    double single = run<SingleQueue>(threads, tasks);
+    double stealing = run<StealQueue<Item, Newer>>(threads, tasks);
+    printf("%8u %24.2f %24.2f\n", threads, single, stealing);
+  }
+
+  return 0;
+}
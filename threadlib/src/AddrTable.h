@@ -0,0 +1,80 @@
+#ifndef ADDRTABLE_H
+#define ADDRTABLE_H
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+namespace threadlib {
+
+// Lock-striped hash table keyed by address. Each shard has its own mutex so
+// accesses to disjoint addresses only contend when they hash to the same
+// shard, and every access is a single lookup done under one lock.
+template<class Value, uint32_t NumShards = 64>
+class AddrTable {
+  static_assert((NumShards & (NumShards - 1)) == 0, "NumShards must be a power of two");
+
+public:
+  // Runs fn on the entry for addr (default constructing it if needed) while
+  // holding the shard lock, returning whatever fn returns.
+  template<class Fn>
+  auto access(void *addr, Fn &&fn){
+    Shard &shard = getShard(addr);
+    std::scoped_lock lock(shard.m_mutex);
+    return fn(shard.m_map[addr]);
+  }
+
+  // Returns the entry for addr, default constructing it if needed. The
+  // reference stays valid until clear(), so entries that synchronise
+  // themselves can be used without holding the shard lock.
+  Value &get(void *addr){
+    Shard &shard = getShard(addr);
+    std::scoped_lock lock(shard.m_mutex);
+    return shard.m_map[addr];
+  }
+
+  template<class Fn>
+  void forEach(Fn &&fn){
+    for(Shard &shard : m_shards){
+      std::scoped_lock lock(shard.m_mutex);
+      for(auto &it : shard.m_map) fn(it.first, it.second);
+    }
+  }
+
+  size_t size(){
+    size_t total = 0;
+    for(Shard &shard : m_shards){
+      std::scoped_lock lock(shard.m_mutex);
+      total += shard.m_map.size();
+    }
+    return total;
+  }
+
+  void clear(){
+    for(Shard &shard : m_shards){
+      std::scoped_lock lock(shard.m_mutex);
+      shard.m_map.clear();
+    }
+  }
+
+protected:
+  struct alignas(64) Shard {
+    std::mutex m_mutex;
+    std::unordered_map<void *, Value> m_map;
+  };
+
+  static uint32_t getShardIndex(void *addr){
+    // Fibonacci hashing, dropping the low bits which are mostly alignment
+    uint64_t key = ((uint64_t)(uintptr_t)addr >> 3) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(key >> 32) & (NumShards - 1);
+  }
+
+  Shard &getShard(void *addr){
+    return m_shards[getShardIndex(addr)];
+  }
+
+  Shard m_shards[NumShards];
+};
+}
+
+#endif
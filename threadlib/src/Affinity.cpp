@@ -0,0 +1,100 @@
+#include "Affinity.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <tuple>
+
+#include <dirent.h>
+#include <sched.h>
+
+using namespace threadlib;
+
+namespace {
+struct CpuInfo {
+  int m_cpu;
+  int m_node;
+  int m_core;
+
+  // Position among the hardware threads of its core
+  int m_thread;
+};
+}
+
+static int readInt(const char *path, int value){
+  std::ifstream file(path);
+  file >> value;
+  return value;
+}
+
+// NUMA node of the CPU, falling back to its socket without NUMA in sysfs
+static int getNode(int cpu){
+  char path[128];
+  std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+  int node = -1;
+  if(DIR *dir = opendir(path)) {
+    while(dirent *entry = readdir(dir)){
+      if(!std::strncmp(entry->d_name, "node", 4) && std::sscanf(entry->d_name + 4, "%d", &node) == 1) break;
+    }
+    closedir(dir);
+  }
+  if(node >= 0) return node;
+
+  std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+  return readInt(path, 0);
+}
+
+std::vector<int> threadlib::getWorkerCpus(Affinity policy){
+  std::vector<int> cpus;
+  if(policy == Affinity::None) return cpus;
+
+  cpu_set_t set;
+  if(sched_getaffinity(0, sizeof(set), &set)) return cpus;
+
+  std::vector<CpuInfo> infos;
+  std::map<std::pair<int, int>, int> coreThreads;
+  for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+    if(!CPU_ISSET(cpu, &set)) continue;
+
+    char path[128];
+    std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+    int node = getNode(cpu);
+    int core = readInt(path, cpu);
+    infos.push_back(CpuInfo{cpu, node, core, coreThreads[{node, core}]++});
+  }
+
+  if(policy == Affinity::Compact) {
+    // Hardware threads of a core next to each other, nodes one after another
+    std::sort(infos.begin(), infos.end(), [](const CpuInfo &lhs, const CpuInfo &rhs){
+      return std::tie(lhs.m_node, lhs.m_core, lhs.m_thread) < std::tie(rhs.m_node, rhs.m_core, rhs.m_thread);
+    });
+    for(const CpuInfo &info : infos) cpus.push_back(info.m_cpu);
+    return cpus;
+  }
+
+  // Scatter: every core before a second thread on any of them, taking one
+  // CPU from each node in turn
+  std::sort(infos.begin(), infos.end(), [](const CpuInfo &lhs, const CpuInfo &rhs){
+    return std::tie(lhs.m_thread, lhs.m_core, lhs.m_cpu) < std::tie(rhs.m_thread, rhs.m_core, rhs.m_cpu);
+  });
+
+  std::map<int, std::vector<int>> nodes;
+  for(const CpuInfo &info : infos) nodes[info.m_node].push_back(info.m_cpu);
+
+  for(size_t i = 0; cpus.size() < infos.size(); i++){
+    for(auto &node : nodes){
+      if(i < node.second.size()) cpus.push_back(node.second[i]);
+    }
+  }
+  return cpus;
+}
+
+bool threadlib::pinCurrentThread(int cpu){
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return !sched_setaffinity(0, sizeof(set), &set);
+}
@@ -0,0 +1,18 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include "Config.h"
+
+#include <vector>
+
+namespace threadlib {
+
+// The CPUs this process may run on, in the order workers are pinned to them
+// under policy. Empty with Affinity::None or if the topology can't be read
+std::vector<int> getWorkerCpus(Affinity policy);
+
+// Pins the calling thread to cpu
+bool pinCurrentThread(int cpu);
+}
+
+#endif
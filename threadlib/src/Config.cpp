@@ -0,0 +1,129 @@
+#include "Config.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <sched.h>
+
+using namespace threadlib;
+
+static uint32_t getUInt(const char *name, uint32_t value){
+  const char *str = std::getenv(name);
+  if(!str) return value;
+
+  char *end = nullptr;
+  unsigned long parsed = std::strtoul(str, &end, 10);
+  if(end == str || *end || parsed == 0) {
+    std::cerr << "threadlib: invalid value " << str << " for " << name << "\n";
+    return value;
+  }
+
+  return (uint32_t)parsed;
+}
+
+// CPUs worth of time the cgroup may use per period, or 0 if unlimited
+static uint32_t cgroupQuota(){
+  long long quota = -1, period = 0;
+
+  // cgroup v2 writes "<quota> <period>", with "max" for no limit
+  std::ifstream v2("/sys/fs/cgroup/cpu.max");
+  std::string max;
+  if(v2 >> max >> period) {
+    if(max != "max") quota = std::atoll(max.c_str());
+  } else {
+    std::ifstream v1Quota("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+    std::ifstream v1Period("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+    if(!(v1Quota >> quota) || !(v1Period >> period)) return 0;
+  }
+
+  if(quota <= 0 || period <= 0) return 0;
+  return (uint32_t)((quota + period - 1) / period);
+}
+
+uint32_t Config::availableCpus(){
+  uint32_t cpus = 0;
+  cpu_set_t set;
+  if(!sched_getaffinity(0, sizeof(set), &set)) cpus = CPU_COUNT(&set);
+  if(!cpus) cpus = std::thread::hardware_concurrency();
+  if(!cpus) cpus = 1;
+
+  uint32_t quota = cgroupQuota();
+  if(quota && quota < cpus) cpus = quota;
+  return cpus;
+}
+
+const Config &Config::get(){
+  static Config config;
+  return config;
+}
+
+Config::Config() : m_backend(ConflictBackend::Table), m_granularityShift(0), m_versioning(Versioning::Eager), m_printStats(false), m_schedule{Schedule::Guided, 0, 0}, m_affinity(Affinity::None), m_adaptive(false) {
+  if(const char *backend = std::getenv("THREADLIB_CONFLICT_BACKEND")){
+    if(!std::strcmp(backend, "shadow")) m_backend = ConflictBackend::Shadow;
+    else if(!std::strcmp(backend, "signature")) m_backend = ConflictBackend::Signature;
+    else if(std::strcmp(backend, "table")) {
+      std::cerr << "threadlib: unknown conflict backend " << backend << ", using table\n";
+    }
+  }
+
+  m_signatureBits = getUInt("THREADLIB_SIGNATURE_BITS", 2048);
+  m_window = getUInt("THREADLIB_WINDOW", 1 << 16);
+  m_numThreads = getUInt("THREADLIB_NUM_THREADS", 0);
+  if(!m_numThreads) m_numThreads = availableCpus();
+  m_signatureHashes = getUInt("THREADLIB_SIGNATURE_HASHES", 4);
+
+  if(const char *granularity = std::getenv("THREADLIB_GRANULARITY")){
+    if(!std::strcmp(granularity, "word")) m_granularityShift = 3;
+    else if(!std::strcmp(granularity, "line")) m_granularityShift = 6;
+    else if(!std::strcmp(granularity, "page")) m_granularityShift = 12;
+    else if(std::strcmp(granularity, "byte")) {
+      std::cerr << "threadlib: unknown granularity " << granularity << ", using byte\n";
+    }
+  }
+
+  if(const char *versioning = std::getenv("THREADLIB_VERSIONING")){
+    if(!std::strcmp(versioning, "lazy")) m_versioning = Versioning::Lazy;
+    else if(std::strcmp(versioning, "eager")) {
+      std::cerr << "threadlib: unknown versioning " << versioning << ", using eager\n";
+    }
+  }
+
+  if(const char *affinity = std::getenv("THREADLIB_AFFINITY")){
+    if(!std::strcmp(affinity, "compact")) m_affinity = Affinity::Compact;
+    else if(!std::strcmp(affinity, "scatter")) m_affinity = Affinity::Scatter;
+    else if(std::strcmp(affinity, "none")) {
+      std::cerr << "threadlib: unknown affinity " << affinity << ", using none\n";
+    }
+  }
+
+  if(const char *stats = std::getenv("THREADLIB_STATS")) m_printStats = std::strcmp(stats, "0");
+  if(const char *adaptive = std::getenv("THREADLIB_ADAPTIVE")) m_adaptive = std::strcmp(adaptive, "0");
+  if(const char *profile = std::getenv("THREADLIB_PROFILE")) m_profilePath = profile;
+
+  // Signatures summarise a whole task, so a range straddling another task's
+  // timestamp looks later than it. One iteration per task keeps them exact
+  if(m_backend == ConflictBackend::Signature) m_schedule.m_kind = Schedule::Dynamic;
+
+  if(const char *schedule = std::getenv("THREADLIB_SCHEDULE")){
+    const char *comma = std::strchr(schedule, ',');
+    std::string kind = comma ? std::string(schedule, comma) : std::string(schedule);
+
+    if(kind == "static") m_schedule.m_kind = Schedule::Static;
+    else if(kind == "dynamic") m_schedule.m_kind = Schedule::Dynamic;
+    else if(kind != "guided") {
+      std::cerr << "threadlib: unknown schedule " << kind << ", using guided\n";
+    }
+
+    if(comma) {
+      char *end = nullptr;
+      long long chunk = std::strtoll(comma + 1, &end, 10);
+      if(end == comma + 1 || *end || chunk <= 0) {
+        std::cerr << "threadlib: invalid chunk size " << comma + 1 << "\n";
+      } else m_schedule.m_chunkSize = chunk;
+    }
+  }
+}
@@ -0,0 +1,110 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <cstdint>
+#include <string>
+
+namespace threadlib {
+
+enum class ConflictBackend {
+  Table,
+  Shadow,
+  Signature
+};
+
+// None is never configured, it is used for loops the compiler proved have
+// independent iterations, which run without checks or saved values
+enum class Versioning {
+  Eager,
+  Lazy,
+  None
+};
+
+// Where workers are pinned. Compact fills the cores of one NUMA node before
+// moving to the next, scatter spreads consecutive workers over the nodes
+enum class Affinity {
+  None,
+  Compact,
+  Scatter
+};
+
+// How a loop's iterations are split into tasks, as in OpenMP. Static makes
+// one block per worker (or chunks of m_chunkSize handed out round-robin),
+// dynamic makes chunks of m_chunkSize, and guided makes chunks that shrink
+// with the iterations left, down to m_chunkSize
+enum class Schedule : int32_t {
+  Static = 0,
+  Dynamic = 1,
+  Guided = 2
+};
+
+struct LoopSchedule {
+  Schedule m_kind;
+  int64_t m_chunkSize;
+
+  // Workers that run the loop, 0 for the whole pool
+  uint32_t m_numThreads;
+};
+
+// Runtime options, read once from the environment:
+//   THREADLIB_CONFLICT_BACKEND=table|shadow|signature
+//   THREADLIB_SIGNATURE_BITS=<bits per read/write signature>
+//   THREADLIB_SIGNATURE_HASHES=<hash functions per signature>
+//   THREADLIB_GRANULARITY=byte|word|line|page
+//   THREADLIB_VERSIONING=eager|lazy
+//   THREADLIB_STATS=0|1
+//   THREADLIB_SCHEDULE=static|dynamic|guided[,chunk]
+//   THREADLIB_WINDOW=<iterations>
+//   THREADLIB_NUM_THREADS=<workers>
+//   THREADLIB_AFFINITY=none|compact|scatter
+//   THREADLIB_ADAPTIVE=0|1
+//   THREADLIB_PROFILE=<file>
+class Config {
+public:
+  static const Config &get();
+
+  ConflictBackend m_backend;
+
+  uint32_t m_signatureBits;
+  uint32_t m_signatureHashes;
+
+  // log2 of the size of the blocks conflicts are tracked at
+  uint32_t m_granularityShift;
+
+  // Eager writes to memory and saves the old value, lazy buffers each task's
+  // writes until the job commits
+  Versioning m_versioning;
+
+  // Time the workers spend idle and executing tasks, printed after each
+  // top-level loop
+  bool m_printStats;
+
+  // Schedule of loops that don't set their own
+  LoopSchedule m_schedule;
+
+  // Iterations of a top-level loop past the oldest unfinished one that can
+  // be queued or running
+  uint64_t m_window;
+
+  // Size of the thread pool, by default the CPUs this process may run on
+  uint32_t m_numThreads;
+
+  Affinity m_affinity;
+
+  // Decide per loop whether to speculate and with how many workers, from how
+  // its earlier runs went
+  bool m_adaptive;
+
+  // File the per-loop statistics are added to at exit, for the loop
+  // extraction pass to read. Empty if not profiling
+  std::string m_profilePath;
+
+  // CPUs in the affinity mask, capped by the cgroup CPU quota
+  static uint32_t availableCpus();
+
+protected:
+  Config();
+};
+}
+
+#endif
@@ -0,0 +1,80 @@
+#include "ConflictTracker.h"
+#include "ThreadPool.h"
+
+#include <iostream>
+
+using namespace threadlib;
+
+void AddrHistory::lock(){
+  while(m_locked.exchange(true, std::memory_order_acquire)){
+    while(m_locked.load(std::memory_order_relaxed));
+  }
+}
+
+void AddrHistory::unlock(){
+  m_locked.store(false, std::memory_order_release);
+}
+
+bool AddrHistory::load(const Timestamp &t, uint64_t iteration){
+  lock();
+  if(!(m_lastRead > t)) {
+    m_lastRead = t;
+    m_reader = iteration;
+  }
+  bool conflict = m_lastWrite > t;
+  unlock();
+
+  return conflict;
+}
+
+bool AddrHistory::store(const Timestamp &t, uint64_t iteration, bool record, bool &newEntry){
+  lock();
+  newEntry = !m_writer;
+  bool conflict = m_lastWrite > t || m_lastRead > t;
+  if(record && !(m_lastWrite > t)) {
+    m_lastWrite = t;
+    m_writer = iteration;
+  }
+  unlock();
+
+  return conflict;
+}
+
+void AddrHistory::clear(){
+  m_writer = 0;
+  m_reader = 0;
+  m_lastWrite = Timestamp();
+  m_lastRead = Timestamp();
+}
+
+bool TableTracker::checkLoad(void *addr, Task &task){
+  return m_addrMap.get(addr).load(task.getTimestamp(), task.getIteration());
+}
+
+bool TableTracker::checkStore(void *addr, Task &task, bool record, bool &newEntry){
+  return m_addrMap.get(addr).store(task.getTimestamp(), task.getIteration(), record, newEntry);
+}
+
+static void printTimestamp(const Timestamp &t){
+  if(!t.size()) {
+    std::cout << "none";
+    return;
+  }
+
+  std::cout << "[";
+  for(uint32_t i = 0; i < t.size(); i++){
+    std::cout << (i ? ", " : "") << t[i];
+  }
+  std::cout << "]";
+}
+
+void TableTracker::printHistory(){
+  std::cout << "Write map size: " << m_addrMap.size() << "\nEntries:\n";
+  m_addrMap.forEach([](void *addr, AddrHistory &history){
+    std::cout << "\t" << addr << ": Last read: ";
+    printTimestamp(history.m_lastRead);
+    std::cout << " Last write: ";
+    printTimestamp(history.m_lastWrite);
+    std::cout << "\n";
+  });
+}
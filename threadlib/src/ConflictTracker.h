@@ -0,0 +1,84 @@
+#ifndef CONFLICTTRACKER_H
+#define CONFLICTTRACKER_H
+
+#include "AddrTable.h"
+#include "Timestamp.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace threadlib {
+
+class Task;
+
+// Latest reader and writer of an address. The checks only ask whether a
+// task later than t has touched the address, so the latest of each is all we
+// need to keep. Their timestamps are copied in, as a task's changes with
+// every iteration, under a spin lock that also keeps two racing accesses
+// from missing each other. m_writer and m_reader identify the iterations
+// that made the accesses for the inline shadow checks, and are 0 while
+// nothing is recorded.
+struct AddrHistory {
+  std::atomic<uint64_t> m_writer{0};
+  std::atomic<uint64_t> m_reader{0};
+  std::atomic<bool> m_locked{false};
+  Timestamp m_lastWrite;
+  Timestamp m_lastRead;
+
+  // Records the read by iteration t. Read by t1 to line written by t2 =
+  // conflict
+  bool load(const Timestamp &t, uint64_t iteration);
+
+  // Records the write by iteration t if record is set. Read by t2 and then
+  // written by t1, or write by t1 to a line written by t2 = conflict
+  bool store(const Timestamp &t, uint64_t iteration, bool record, bool &newEntry);
+
+  void clear();
+
+protected:
+  void lock();
+  void unlock();
+};
+
+// Conflict detection backend used by a JobState. checkLoad/checkStore test
+// the access by task against the recorded history and record it, returning
+// true if it conflicts. Writes are only recorded if record is set, and
+// newEntry is set when the address may not have been written before this
+// access. Backends that validate whole tasks do so in finishTask.
+class ConflictTracker {
+public:
+  virtual ~ConflictTracker(){}
+
+  virtual bool checkLoad(void *addr, Task &task) = 0;
+  virtual bool checkStore(void *addr, Task &task, bool record, bool &newEntry) = 0;
+
+  virtual void startTask(Task &){}
+  virtual bool finishTask(Task &){ return false; }
+
+  // Called once [addr, addr + size) is in the undo log
+  virtual void markSaved(void *, size_t, uint32_t){}
+
+  // True for backends that only find conflicts in finishTask, by comparing
+  // whole tasks, so it makes no difference when an access was checked
+  virtual bool validatesTasks(){ return false; }
+
+  // True if newEntry is only set for the first store to an address in the
+  // whole job, so no two tasks save the same address
+  virtual bool findsFirstWrites(){ return true; }
+
+  virtual void printHistory() = 0;
+};
+
+class TableTracker : public ConflictTracker {
+public:
+  bool checkLoad(void *addr, Task &task) override;
+  bool checkStore(void *addr, Task &task, bool record, bool &newEntry) override;
+
+  void printHistory() override;
+
+protected:
+  AddrTable<AddrHistory> m_addrMap;
+};
+}
+
+#endif
@@ -1,120 +1,315 @@
 #include "JobState.h"
+#include "RedoLog.h"
+#include "ShadowMemory.h"
+#include "Signature.h"
 #include "ThreadPool.h"
 
+#include <algorithm>
 #include <iostream>
 #include <cassert>
 #include <thread>
 #include <cstring>
+#include <unordered_set>
 
 using namespace threadlib;
 
-JobState::JobState(ThreadPool *threadpool) : m_noConflicts(true), m_threadpool(threadpool){}
+JobState::JobState(ThreadPool *threadpool, Versioning versioning) 
+  : m_noConflicts(true), 
+    m_threadpool(threadpool), 
+    m_tracker(nullptr),
+    m_inlineOwner(nullptr),
+    m_granularityShift(Config::get().m_granularityShift),
+    m_versioning(versioning),
+    m_workerLogs(nullptr),
+    m_numWorkerLogs(0),
+    m_saveClock(0){
+  const Config &config = Config::get();
+  ShadowMemory *shadow = threadpool->getShadowMemory();
+
+  if(versioning == Versioning::None) return;
+  else if(shadow) {
+    ShadowTracker *tracker = new ShadowTracker(shadow);
+    if(versioning == Versioning::Eager) m_inlineOwner = tracker;
+    m_tracker = tracker;
+  } else if(config.m_backend == ConflictBackend::Signature) {
+    m_tracker = new SignatureTracker(config.m_signatureBits, config.m_signatureHashes);
+  } else m_tracker = new TableTracker();
+
+  if(versioning == Versioning::Eager) {
+    m_numWorkerLogs = threadpool->getSize();
+    m_workerLogs = new WorkerLog[m_numWorkerLogs];
+  }
+}
 
 bool JobState::noConflicts(){
-  std::scoped_lock lock(m_mutex);
   return m_noConflicts;
 }
 
-void JobState::doesLoadConflict(void *addr, bool updateStatus){ 
-  const Timestamp &t = m_threadpool->getTimestampForCurrentThread();
-  std::scoped_lock load(m_mutex);
+// Calls fn with the base address of every granule [addr, addr + size) touches
+template<class Fn>
+static void forEachGranule(void *addr, size_t size, uint32_t shift, Fn &&fn){
+  uintptr_t first = (uintptr_t)addr >> shift;
+  uintptr_t last = ((uintptr_t)addr + (size ? size : 1) - 1) >> shift;
+
+  for(uintptr_t granule = first; granule <= last; granule++){
+    fn((void *)(granule << shift));
+  }
+}
+
+void *JobState::checkLoad(void *addr, size_t size){ 
+  if(m_versioning == Versioning::None) return addr;
 
-  if(m_addrMap.find(addr) == m_addrMap.end()) return;
+  Task *task = m_threadpool->getTaskForCurrentThread();
+  task->countCheck();
+  if(m_versioning == Versioning::Lazy) return task->getRedoLog()->load(addr, size);
 
-  // read by t1 to line written by t2 = conflict
-  auto WAR = m_addrMap[addr].m_writes.upper_bound(&t);
-  bool conflict = WAR != m_addrMap[addr].m_writes.end();
+  bool conflict = false;
+  forEachGranule(addr, size, m_granularityShift, [&](void *granule){
+    conflict |= m_tracker->checkLoad(granule, *task);
+  });
 
   //if(conflict) std::cout << "READ CONFLICT DETECTED\n";
-  if(conflict && updateStatus) m_noConflicts = false; 
+  if(conflict) m_noConflicts = false; 
+  return addr;
 }
 
-void JobState::doesStoreConflict(void *addr, bool updateStatus){
-  const Timestamp &t = m_threadpool->getTimestampForCurrentThread();
-  std::scoped_lock lock(m_mutex);
+void *JobState::checkStore(void *addr, size_t size){
+  if(m_versioning == Versioning::None) return addr;
 
-  if(m_addrMap.find(addr) == m_addrMap.end()) return;
-  
-  // read by t2 and then written by t1 = conflict
-  auto RAW = m_addrMap[addr].m_reads.upper_bound(&t);
-  bool conflict = RAW != m_addrMap[addr].m_reads.end();
+  Task *task = m_threadpool->getTaskForCurrentThread();
+  task->countCheck();
+  if(m_versioning == Versioning::Lazy) return task->getRedoLog()->store(addr, size);
+
+  bool newEntry = false;
+  bool conflict = false;
+  forEachGranule(addr, size, m_granularityShift, [&](void *granule){
+    bool newGranule = false;
+    conflict |= m_tracker->checkStore(granule, *task, m_noConflicts, newGranule);
+    newEntry |= newGranule;
+  });
+
+  // A granule bigger than a byte may already have been written without
+  // every byte in it being saved, so only byte granules can skip the save
+  if(m_granularityShift) newEntry = true;
 
-  // write by t1 to a line written by t2
-  if(!conflict){
-    auto WAW = m_addrMap[addr].m_writes.upper_bound(&t);
-    conflict = WAW != m_addrMap[addr].m_writes.end();
-  }
-  
   if(conflict) {
     //std::cout << "STORE CONFLICT DETECTED: " << addr << "\n";
+    m_noConflicts = false;
   }
 
-  if(conflict && updateStatus) {
-    m_noConflicts = false;
+  if(newEntry) addRollbackEntry(addr, size);
+
+  // Lets the inline checks skip later stores to the same bytes
+  if(m_inlineOwner) m_tracker->markSaved(addr, size, m_granularityShift);
+  return addr;
+}
+
+// Calls fn for count accesses of size bytes, stride bytes apart from base.
+// Back to back accesses are passed as one, so each granule is looked up
+// once and stores save a single record
+template<class Fn>
+static void forEachAccess(void *base, int64_t stride, int64_t count, size_t size, Fn &&fn){
+  if(stride == (int64_t)size || stride == -(int64_t)size) {
+    uint8_t *first = (uint8_t *)base + (stride < 0 ? (count - 1) * stride : 0);
+    fn(first, count * size);
+    return;
+  }
+
+  for(int64_t i = 0; i < count; i++){
+    fn((uint8_t *)base + i * stride, size);
   }
 }
 
-void JobState::addRead(void *addr){
-  const Timestamp &t = m_threadpool->getTimestampForCurrentThread();
-  std::scoped_lock lock(m_mutex);
-  m_addrMap[addr].m_reads.insert(&t);
+bool JobState::checkRange(void *base, int64_t stride, int64_t count, size_t size, bool write){
+  if(m_versioning == Versioning::Lazy) return false;
+  if(m_versioning == Versioning::None || count <= 0) return true;
+
+  forEachAccess(base, stride, count, size, [&](void *addr, size_t size){
+    if(write) checkStore(addr, size);
+    else checkLoad(addr, size);
+  });
+
+  holdRange(base, stride, count, size, write);
+  return true;
+}
+
+void JobState::holdRange(void *base, int64_t stride, int64_t count, size_t size, bool write){
+  if(m_versioning != Versioning::Eager || m_tracker->validatesTasks()) return;
+  m_threadpool->getTaskForCurrentThread()->getHeldRanges().push_back({base, stride, count, size, write});
+}
+
+void *JobState::checkLoadAhead(void *addr, size_t size){
+  void *result = checkLoad(addr, size);
+  holdRange(addr, (int64_t)size, 1, size, false);
+  return result;
+}
+
+void *JobState::checkStoreAhead(void *addr, size_t size){
+  void *result = checkStore(addr, size);
+  holdRange(addr, (int64_t)size, 1, size, true);
+  return result;
+}
+
+bool JobState::checkLoadRange(void *base, int64_t stride, int64_t count, size_t size){
+  return checkRange(base, stride, count, size, false);
+}
+
+bool JobState::checkStoreRange(void *base, int64_t stride, int64_t count, size_t size){
+  return checkRange(base, stride, count, size, true);
+}
+
+void JobState::startTask(Task *task){
+  if(m_versioning == Versioning::None) return;
+  if(m_versioning == Versioning::Lazy) {
+    task->setRedoLog(new RedoLog(m_granularityShift));
+    return;
+  }
+
+  m_tracker->startTask(*task);
 }
 
-void JobState::addEntry(void *addr, size_t size){
-  void **copyTo = nullptr;
-  const Timestamp &t = m_threadpool->getTimestampForCurrentThread(); 
-  {
+void JobState::finishTask(Task *task){
+  if(m_versioning == Versioning::None) return;
+  if(m_versioning == Versioning::Lazy) {
+    RedoLog *log = task->getRedoLog();
+    log->flush();
+    task->setRedoLog(nullptr);
+
+    std::scoped_lock lock(m_mutex);
+    m_finishedTasks.push_back({task->getFirstTimestamp(), log});
+    return;
+  }
+
+  if(m_tracker->finishTask(*task)) m_noConflicts = false;
+}
+
+void JobState::finishIteration(Task *task){
+  std::vector<HeldRange> &held = task->getHeldRanges();
+  if(held.empty()) return;
+
+  // A later task that touched the range since it was checked is still the
+  // latest reader or writer of it
+  bool conflict = false;
+  for(const HeldRange &range : held){
+    forEachAccess(range.m_base, range.m_stride, range.m_count, range.m_size, [&](void *addr, size_t size){
+      forEachGranule(addr, size, m_granularityShift, [&](void *granule){
+        bool newEntry = false;
+        conflict |= range.m_write ? m_tracker->checkStore(granule, *task, false, newEntry) : m_tracker->checkLoad(granule, *task);
+      });
+    });
+  }
+  held.clear();
+
+  if(conflict) m_noConflicts = false;
+}
+
+bool JobState::commit(bool partial, Timestamp &rejected){
   std::scoped_lock lock(m_mutex);
+  if(m_finishedTasks.empty()) return false;
 
-  bool newEntry = m_addrMap.find(addr) == m_addrMap.end();
-  if(!newEntry) newEntry = m_addrMap[addr].m_writes.empty();
+  std::sort(m_finishedTasks.begin(), m_finishedTasks.end(), [](const FinishedTask &lhs, const FinishedTask &rhs){
+    return rhs.m_timestamp > lhs.m_timestamp;
+  });
 
-  if(m_noConflicts) {
-    m_addrMap[addr].m_writes.insert(&t);
+  // A task that read a granule an earlier task wrote saw the old value
+  std::unordered_set<uintptr_t> written;
+  size_t valid = m_finishedTasks.size();
+  for(size_t i = 0; i < m_finishedTasks.size(); i++){
+    RedoLog *log = m_finishedTasks[i].m_log;
+    if(log->readsAny(written)) {
+      m_noConflicts = false;
+      valid = i;
+      break;
+    }
+    log->addWrites(written);
   }
 
-  if(!newEntry || 
-      (!m_noConflicts && m_rollback.find(addr) != m_rollback.end())) return;
+  if(!m_noConflicts && !partial) valid = 0;
+  bool resume = valid < m_finishedTasks.size() && partial;
+  if(resume) rejected = m_finishedTasks[valid].m_timestamp;
 
-  m_rollback[addr] = new VersionEntry(size, nullptr);
-  copyTo = &m_rollback[addr]->m_addr;
+  for(size_t i = 0; i < m_finishedTasks.size(); i++){
+    RedoLog *log = m_finishedTasks[i].m_log;
+    if(i < valid) log->commit();
+    delete log;
   }
+  m_finishedTasks.clear();
+  return resume;
+}
+
+void JobState::addRollbackEntry(void *addr, size_t size){
+  if(!size) return;
+
+  WorkerLog &log = m_workerLogs[ThreadPool::getWorker()];
+  auto it = log.m_saved.find(addr);
+  if(it != log.m_saved.end() && it->second >= size) return;
+
+  // Records of one size at multiples of it can't overlap
+  if(it != log.m_saved.end() || (uintptr_t)addr % size || (log.m_recordSize && log.m_recordSize != size)) log.m_disjoint = false;
+  log.m_recordSize = size;
+  log.m_saved[addr] = size;
+
+  // Numbered before the copy, so a worker saving the bytes this task then
+  // writes gets a later number
+  UndoLog::Record *record = log.m_log.append(addr, size, m_saveClock.fetch_add(1));
 
   // This is thread-safe with rollback() as all tasks must finish
   // before we rollback. As this is part of the task's call stack
   // we can guarantee that this is done before rollback()
-  
-  void *rollbackAddr = malloc((size_t)size);
-  assert(copyTo && "copyTo is nullptr");
-
-  *copyTo = rollbackAddr;
-  std::memcpy(rollbackAddr, addr, size); 
+  std::memcpy(record->getData(), addr, size); 
 }
 
-void JobState::rollback(){
+void JobState::startRollback(){
   std::scoped_lock lock(m_mutex);
   std::cout << "rolling back job\n";
-  for(auto it: m_rollback){
-    void *addr = it.first;
-    VersionEntry *entry = it.second;
 
-    std::memcpy(addr, entry->m_addr, entry->m_size);
+  // The logs of two workers can only hold the same address if the tracker
+  // lets more than one store save it
+  bool disjoint = true;
+  uint32_t logs = 0;
+  size_t recordSize = 0;
+  for(uint32_t i = 0; i < m_numWorkerLogs; i++){
+    WorkerLog &log = m_workerLogs[i];
+    if(!log.m_log.size()) continue;
+
+    if(!log.m_disjoint || (recordSize && recordSize != log.m_recordSize)) disjoint = false;
+    recordSize = log.m_recordSize;
+    logs++;
+
+    m_undoLog.merge(log.m_log);
   }
+  if(logs > 1 && (m_granularityShift || !m_tracker->findsFirstWrites())) disjoint = false;
+
+  m_undoLog.startRestore(disjoint);
+}
+
+bool JobState::canHelpRollback(){
+  return m_undoLog.hasChunksLeft();
+}
+
+void JobState::helpRollback(){
+  m_undoLog.helpRestore();
+}
+
+void JobState::rollback(){
+  std::scoped_lock lock(m_mutex);
+  m_undoLog.restore();
 }
 
 void JobState::printHistory(){
-  std::cout << "Write map size: " << m_addrMap.size() << "\nEntries:\n";
-  for(auto it : m_addrMap){
-    std::cout << "\t" << it.first << ": Reads: " << it.second.m_reads.size() 
-                                  << " Writes: " << it.second.m_writes.size() 
-                                  << "\n";
-  } 
+  if(m_tracker) m_tracker->printHistory();
 }
 
 void JobState::printRollback(){
-  std::cout << "Rollback size: " << m_rollback.size() << "\nEntries:\n";
-  for(auto it : m_rollback){
-    std::cout << "\t" << it.first << ": " << it.second->m_size << "\n";
-  }
+  size_t size = m_undoLog.size();
+  for(uint32_t i = 0; i < m_numWorkerLogs; i++) size += m_workerLogs[i].m_log.size();
+
+  auto print = [](UndoLog::Record *record){
+    std::cout << "\t" << record->m_target << ": " << record->m_size << "\n";
+  };
+
+  std::cout << "Rollback size: " << size << "\nEntries:\n";
+  for(uint32_t i = 0; i < m_numWorkerLogs; i++) m_workerLogs[i].m_log.forEach(print);
+  m_undoLog.forEach(print);
 }
 
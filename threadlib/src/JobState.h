@@ -1,34 +1,23 @@
 #ifndef JOBSTATE_H
 #define JOBSTATE_H
 
-#include <map>
-#include <set>
+#include "Config.h"
+#include "ConflictTracker.h"
+#include "RedoLog.h"
+#include "UndoLog.h"
+
+#include <atomic>
+#include <unordered_map>
 #include <vector>
 #include <mutex>
 
 namespace threadlib { 
 class ThreadPool;
-using Timestamp = std::vector<int64_t>;
-
-struct AddrHistory {
-  std::set<const Timestamp *, std::greater<const Timestamp *>> m_writes;
-  std::set<const Timestamp *, std::greater<const Timestamp *>> m_reads;
-};
-
-struct VersionEntry {
-  size_t m_size;
-  void *m_addr;
-
-  VersionEntry(size_t size, void *addr) : m_size(size), m_addr(addr){}
-
-  ~VersionEntry(){
-    free(m_addr);
-  }
-};
+class Task;
 
 class JobState {
 public:
-  JobState(ThreadPool *threadpool);
+  JobState(ThreadPool *threadpool, Versioning versioning);
 
   ~JobState(){
     //for(auto it : m_addrMap){
@@ -38,37 +27,119 @@ public:
     //  delete it.second;
     //}
 
-    for(auto it: m_rollback){
-      delete it.second;
-    }
+    for(FinishedTask &finished : m_finishedTasks) delete finished.m_log;
+    delete m_tracker;
+    delete[] m_workerLogs;
   }
 
   bool noConflicts();
 
-  void doesLoadConflict(void *addr, bool updateStatus = true);
-  void doesStoreConflict(void *addr, bool updateStatus = true);
+  Versioning getVersioning(){
+    return m_versioning;
+  }
 
-  void addRead(void *addr);
-  void addEntry(void *addr, size_t size);
+  // Owner of this job's shadow cells when the inline shadow checks can stand
+  // in for checkLoad/checkStore, which needs the shadow backend and eager
+  // versioning. Null otherwise
+  const void *getInlineOwner(){
+    return m_inlineOwner;
+  }
 
+  // Checks the access against the address history and records it, with one
+  // lookup into the conflict tracker for every granule [addr, addr + size)
+  // touches. Returns the address the access should go to, which is addr
+  // itself unless the task's writes are buffered in a redo log. Returns addr
+  // straight away for loops proven to have independent iterations. Once the
+  // job has a conflict they still return, the caller aborts the task
+  void *checkLoad(void *addr, size_t size);
+  void *checkStore(void *addr, size_t size);
+
+  // As checkLoad/checkStore, for a check the compiler kept in place of later
+  // accesses to the same memory in the iteration, which makes it one more
+  // access checked ahead of time
+  void *checkLoadAhead(void *addr, size_t size);
+  void *checkStoreAhead(void *addr, size_t size);
+
+  // Checks count accesses of size bytes, stride bytes apart from base, ahead
+  // of a loop making them. Returns false if the accesses have to be checked
+  // one by one instead, which lazy versioning needs to redirect each of them
+  bool checkLoadRange(void *base, int64_t stride, int64_t count, size_t size);
+  bool checkStoreRange(void *base, int64_t stride, int64_t count, size_t size);
+
+  // Called by the worker around each task it runs
+  void startTask(Task *task);
+  void finishTask(Task *task);
+
+  // Called after each iteration of a task. The trackers only see a conflict
+  // when the later task's access is checked second, which a check made
+  // before the accesses doesn't guarantee, so the ranges and accesses the
+  // iteration checked ahead are checked again once all of it ran
+  void finishIteration(Task *task);
+
+  // With lazy versioning, validates the redo logs of the finished tasks and
+  // writes them back in timestamp order if no task read a value an earlier
+  // task wrote. With partial set, the tasks before the first one that did
+  // are still written back, and true is returned with rejected set to that
+  // task's first timestamp, so the loop can be resumed from it. Does nothing
+  // with eager versioning
+  bool commit(bool partial, Timestamp &rejected);
+
+  // The worker finishing the job starts the rollback and restores the saved
+  // values in rollback(). Once started, the workers waiting for the job
+  // help with that in helpRollback()
+  void startRollback();
+  bool canHelpRollback();
+  void helpRollback();
   void rollback();
 
   void printHistory();
   void printRollback();
 
 public:
-  bool m_noConflicts;
+  std::atomic<bool> m_noConflicts;
   std::mutex m_mutex;
 
 protected:
   ThreadPool *m_threadpool;
 
-  //std::map<void *, const Timestamp *> m_writeMap;
-  std::map<void *, AddrHistory> m_addrMap;
-  std::map<void *, VersionEntry *> m_rollback; 
-
-  // TODO: CHANGE TO MAP
-  //std::unordered_map<void *, std::list<VersionEntry *> *> m_addrMap;
+  ConflictTracker *m_tracker;
+  const void *m_inlineOwner;
+  uint32_t m_granularityShift;
+  Versioning m_versioning;
+
+  // Redo logs of the finished tasks waiting for commit(), taken off the
+  // tasks so a streamed loop can reuse them
+  struct FinishedTask {
+    Timestamp m_timestamp;
+    RedoLog *m_log;
+  };
+  std::vector<FinishedTask> m_finishedTasks;
+
+  // Saved values of the tasks one worker ran, only touched by that worker
+  // until the job is rolled back. m_disjoint is cleared once two of its
+  // saved ranges may overlap
+  struct alignas(64) WorkerLog {
+    UndoLog m_log;
+    std::unordered_map<void *, size_t> m_saved;
+    bool m_disjoint = true;
+    size_t m_recordSize = 0;
+  };
+
+  WorkerLog *m_workerLogs;
+  uint32_t m_numWorkerLogs;
+
+  // Numbers the saves of every worker, so restoring them in reverse leaves
+  // every byte with the oldest value saved for it
+  std::atomic<uint64_t> m_saveClock;
+
+  // The workers' logs, merged once the job is rolled back. The restore runs
+  // sequentially unless no two saved ranges overlap
+  UndoLog m_undoLog;
+
+  void addRollbackEntry(void *addr, size_t size);
+
+  bool checkRange(void *base, int64_t stride, int64_t count, size_t size, bool write);
+  void holdRange(void *base, int64_t stride, int64_t count, size_t size, bool write);
 };
 }
 
@@ -0,0 +1,107 @@
+#include "LoopPolicy.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include <dlfcn.h>
+
+using namespace threadlib;
+
+bool LoopPolicy::shouldSpeculate(FunctionPtr func, LoopSchedule &schedule){
+  std::scoped_lock lock(m_mutex);
+  LoopStats &stats = m_loops[func];
+
+  if(stats.m_skip) {
+    stats.m_skip--;
+    stats.m_sequentialRuns++;
+    return false;
+  }
+
+  if(stats.m_numThreads && (!schedule.m_numThreads || stats.m_numThreads < schedule.m_numThreads)) {
+    schedule.m_numThreads = stats.m_numThreads;
+  }
+  return true;
+}
+
+void LoopPolicy::record(FunctionPtr func, uint64_t iterations, uint32_t numThreads, bool success, uint64_t time, uint64_t busy, uint64_t checks){
+  std::scoped_lock lock(m_mutex);
+  LoopStats &stats = m_loops[func];
+
+  stats.m_runs++;
+  stats.m_iterations += iterations;
+
+  if(!success) {
+    stats.m_conflicts++;
+    stats.m_wastedTime += time;
+  } else {
+    stats.m_committedTime += time;
+    stats.m_busyTime += busy;
+    stats.m_checks += checks;
+  }
+
+  // busy / time is the speedup over running the tasks one after another,
+  // which the sequential loop beats without the instrumentation
+  bool backOff = !success || busy < time;
+  if(!backOff && numThreads > 2 && busy * 2 < time * numThreads) stats.m_numThreads = numThreads / 2;
+
+  if(backOff) {
+    stats.m_skip = stats.m_backoff;
+    stats.m_backoff = std::min(stats.m_backoff * 2, MaxBackoff);
+  } else stats.m_backoff = 1;
+}
+
+void LoopPolicy::writeProfile(){
+  if(m_profilePath.empty()) return;
+
+  std::scoped_lock lock(m_mutex);
+  std::map<std::string, LoopStats> profile;
+
+  std::ifstream in(m_profilePath);
+  std::string line;
+  while(std::getline(in, line)){
+    std::istringstream fields(line);
+    std::string name;
+    LoopStats stats;
+    if(fields >> name >> stats.m_runs >> stats.m_conflicts >> stats.m_iterations
+        >> stats.m_committedTime >> stats.m_wastedTime >> stats.m_busyTime >> stats.m_checks) {
+      profile[name] = stats;
+    }
+  }
+  in.close();
+
+  for(auto &it : m_loops){
+    Dl_info info;
+    // Only exported symbols resolve, so programs have to be linked with
+    // -rdynamic for their loops to be profiled
+    if(!dladdr((void *)it.first, &info) || !info.dli_sname) {
+      std::cerr << "threadlib: no symbol for loop body " << (void *)it.first << ", link with -rdynamic to profile it\n";
+      continue;
+    }
+
+    const LoopStats &stats = it.second;
+    LoopStats &total = profile[info.dli_sname];
+    total.m_runs += stats.m_runs;
+    total.m_conflicts += stats.m_conflicts;
+    total.m_iterations += stats.m_iterations;
+    total.m_committedTime += stats.m_committedTime;
+    total.m_wastedTime += stats.m_wastedTime;
+    total.m_busyTime += stats.m_busyTime;
+    total.m_checks += stats.m_checks;
+  }
+
+  std::ofstream out(m_profilePath);
+  if(!out) {
+    std::cerr << "threadlib: can't write profile to " << m_profilePath << "\n";
+    return;
+  }
+
+  for(auto &it : profile){
+    const LoopStats &stats = it.second;
+    out << it.first << " " << stats.m_runs << " " << stats.m_conflicts << " " << stats.m_iterations
+        << " " << stats.m_committedTime << " " << stats.m_wastedTime << " " << stats.m_busyTime
+        << " " << stats.m_checks << "\n";
+  }
+}
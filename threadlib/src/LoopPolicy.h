@@ -0,0 +1,73 @@
+#ifndef LOOPPOLICY_H
+#define LOOPPOLICY_H
+
+#include "Config.h"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace threadlib {
+
+using FunctionPtr = void(*)(int64_t, void*);
+
+// What the runtime has seen of one top-level loop, keyed by its body
+struct LoopStats {
+  uint64_t m_runs = 0;
+  uint64_t m_conflicts = 0;
+  uint64_t m_sequentialRuns = 0;
+  uint64_t m_iterations = 0;
+
+  // Nanoseconds of wall time for runs that committed and runs that were
+  // rolled back, and of worker time spent in the committed runs' tasks
+  uint64_t m_committedTime = 0;
+  uint64_t m_wastedTime = 0;
+  uint64_t m_busyTime = 0;
+
+  // Conflict checks made by the tasks of the committed runs
+  uint64_t m_checks = 0;
+
+  // Runs to leave to the sequential loop before speculating again, and how
+  // many the next conflict will skip
+  uint32_t m_skip = 0;
+  uint32_t m_backoff = 1;
+
+  // Workers the loop speculates with, 0 until a run showed it can't use
+  // the whole pool
+  uint32_t m_numThreads = 0;
+};
+
+// Decides online, for each top-level loop, whether to speculate and on how
+// many workers. A conflict, or a run that didn't beat running its tasks one
+// after another, sends the loop back to its sequential version for a number
+// of runs that doubles every time it happens again. A run that kept its
+// workers busy for less than half of the time halves them
+class LoopPolicy {
+public:
+  static constexpr uint32_t MaxBackoff = 64;
+
+  LoopPolicy(const std::string &profilePath) : m_profilePath(profilePath){}
+
+  // False if the loop should run sequentially this time. Otherwise schedule
+  // is limited to the workers the loop should speculate with
+  bool shouldSpeculate(FunctionPtr func, LoopSchedule &schedule);
+
+  // Records a speculative run that took time nanoseconds, of which the
+  // workers spent busy running tasks, and made checks conflict checks
+  void record(FunctionPtr func, uint64_t iterations, uint32_t numThreads, bool success, uint64_t time, uint64_t busy, uint64_t checks);
+
+  // Adds the statistics of every loop to those already in the profile file,
+  // if there is one, with one line per loop body symbol:
+  //   <symbol> <runs> <conflicts> <iterations> <committed ns> <wasted ns> <busy ns> <checks>
+  // Loops whose body has no symbol are left out
+  void writeProfile();
+
+protected:
+  std::string m_profilePath;
+  std::mutex m_mutex;
+  std::unordered_map<FunctionPtr, LoopStats> m_loops;
+};
+}
+
+#endif
@@ -0,0 +1,157 @@
+#include "RedoLog.h"
+
+#include <cstring>
+
+using namespace threadlib;
+
+static uint64_t getMask(uintptr_t offset, size_t size){
+  if(size >= RedoLog::LineSize) return ~0ull;
+  return ((1ull << size) - 1) << offset;
+}
+
+// Calls fn(line, offset in line, offset in access, length) for each piece of
+// [addr, addr + size) that falls in a different cache line
+template<class Fn>
+static void forEachPiece(uintptr_t addr, size_t size, Fn &&fn){
+  size_t done = 0;
+  while(done < size){
+    uintptr_t current = addr + done;
+    uintptr_t offset = current & (RedoLog::LineSize - 1);
+    size_t len = std::min(size - done, (size_t)(RedoLog::LineSize - offset));
+
+    fn(current >> RedoLog::LineShift, offset, done, len);
+    done += len;
+  }
+}
+
+template<class Fn>
+void RedoLog::forEachGranule(uintptr_t addr, size_t size, Fn &&fn){
+  uintptr_t first = addr >> m_granularityShift;
+  uintptr_t last = (addr + size - 1) >> m_granularityShift;
+
+  for(uintptr_t granule = first; granule <= last; granule++) fn(granule);
+}
+
+RedoLog::Line *RedoLog::findLine(uintptr_t line){
+  auto it = m_lines.find(line);
+  return it == m_lines.end() ? nullptr : &it->second;
+}
+
+RedoLog::Line *RedoLog::getLine(uintptr_t line){
+  auto [it, inserted] = m_lines.try_emplace(line);
+  if(inserted){
+    // Memory doesn't change until the job commits, so the rest of the line
+    // can be served from this copy
+    std::memcpy(it->second.m_data, (void *)(line << LineShift), LineSize);
+    it->second.m_dirty = 0;
+  }
+  return &it->second;
+}
+
+bool RedoLog::isOwnWrite(uintptr_t addr, size_t size){
+  bool own = true;
+  forEachPiece(addr, size, [&](uintptr_t lineIdx, uintptr_t offset, size_t, size_t len){
+    Line *line = own ? findLine(lineIdx) : nullptr;
+    uint64_t mask = getMask(offset, len);
+    own = line && (line->m_dirty & mask) == mask;
+  });
+  return own;
+}
+
+void *RedoLog::load(void *addr, size_t size){
+  flush();
+  if(!size) size = 1;
+
+  uintptr_t a = (uintptr_t)addr;
+
+  // Reading back this task's own writes doesn't depend on earlier tasks
+  if(!isOwnWrite(a, size)){
+    forEachGranule(a, size, [&](uintptr_t granule){ m_reads.insert(granule); });
+  }
+
+  if((a >> LineShift) == ((a + size - 1) >> LineShift)){
+    Line *line = findLine(a >> LineShift);
+    return line ? line->m_data + (a & (LineSize - 1)) : addr;
+  }
+
+  if(m_scratch.size() < size) m_scratch.resize(size);
+  forEachPiece(a, size, [&](uintptr_t lineIdx, uintptr_t offset, size_t done, size_t len){
+    Line *line = findLine(lineIdx);
+    uint8_t *src = line ? line->m_data : (uint8_t *)(lineIdx << LineShift);
+    std::memcpy(m_scratch.data() + done, src + offset, len);
+  });
+  return m_scratch.data();
+}
+
+void *RedoLog::store(void *addr, size_t size){
+  flush();
+  if(!size) size = 1;
+
+  uintptr_t a = (uintptr_t)addr;
+  forEachGranule(a, size, [&](uintptr_t granule){ m_writes.insert(granule); });
+
+  if((a >> LineShift) == ((a + size - 1) >> LineShift)){
+    uintptr_t offset = a & (LineSize - 1);
+    Line *line = getLine(a >> LineShift);
+    line->m_dirty |= getMask(offset, size);
+    return line->m_data + offset;
+  }
+
+  // The store lands in the scratch buffer and is moved into its lines on the
+  // next access by this task
+  if(m_scratch.size() < size) m_scratch.resize(size);
+  m_pendingAddr = addr;
+  m_pendingSize = size;
+  return m_scratch.data();
+}
+
+void RedoLog::flush(){
+  if(!m_pendingAddr) return;
+
+  forEachPiece((uintptr_t)m_pendingAddr, m_pendingSize, [&](uintptr_t lineIdx, uintptr_t offset, size_t done, size_t len){
+    Line *line = getLine(lineIdx);
+    std::memcpy(line->m_data + offset, m_scratch.data() + done, len);
+    line->m_dirty |= getMask(offset, len);
+  });
+
+  m_pendingAddr = nullptr;
+  m_pendingSize = 0;
+}
+
+bool RedoLog::readsAny(const std::unordered_set<uintptr_t> &written){
+  for(uintptr_t granule : m_reads){
+    if(written.count(granule)) return true;
+  }
+  return false;
+}
+
+void RedoLog::addWrites(std::unordered_set<uintptr_t> &written){
+  written.insert(m_writes.begin(), m_writes.end());
+}
+
+void RedoLog::commit(){
+  flush();
+
+  for(auto &it : m_lines){
+    uint8_t *dest = (uint8_t *)(it.first << LineShift);
+    Line &line = it.second;
+
+    if(line.m_dirty == ~0ull){
+      std::memcpy(dest, line.m_data, LineSize);
+      continue;
+    }
+
+    // Copy each run of dirty bytes
+    uint32_t i = 0;
+    while(i < LineSize){
+      if(!(line.m_dirty >> i & 1)) {
+        i++;
+        continue;
+      }
+
+      uint32_t start = i;
+      while(i < LineSize && (line.m_dirty >> i & 1)) i++;
+      std::memcpy(dest + start, line.m_data + start, i - start);
+    }
+  }
+}
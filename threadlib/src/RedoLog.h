@@ -0,0 +1,72 @@
+#ifndef REDOLOG_H
+#define REDOLOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace threadlib {
+
+// Private write buffer of one task for lazy versioning. Stores are redirected
+// into a copy of the cache line they touch and only reach memory in
+// commit(), and loads are served from the buffer when the task has written
+// that line. The read and write sets are kept at the tracking granularity so
+// the job can be validated before anything is written back.
+class RedoLog {
+public:
+  static constexpr uint32_t LineShift = 6;
+  static constexpr uintptr_t LineSize = 1ull << LineShift;
+
+  RedoLog(uint32_t granularityShift)
+    : m_granularityShift(granularityShift), m_pendingAddr(nullptr), m_pendingSize(0){}
+
+  // Return the address the access should be made to instead of addr. The
+  // pointer is only valid until the next call.
+  void *load(void *addr, size_t size);
+  void *store(void *addr, size_t size);
+
+  // Moves a store that straddled cache lines from the scratch buffer into the
+  // lines it belongs to
+  void flush();
+
+  // True if this task read a granule in written
+  bool readsAny(const std::unordered_set<uintptr_t> &written);
+  void addWrites(std::unordered_set<uintptr_t> &written);
+
+  // Writes every buffered byte back to memory
+  void commit();
+
+  size_t size(){
+    return m_lines.size();
+  }
+
+protected:
+  struct Line {
+    uint8_t m_data[LineSize];
+    uint64_t m_dirty;
+  };
+
+  Line *findLine(uintptr_t line);
+  Line *getLine(uintptr_t line);
+
+  template<class Fn>
+  void forEachGranule(uintptr_t addr, size_t size, Fn &&fn);
+  bool isOwnWrite(uintptr_t addr, size_t size);
+
+protected:
+  uint32_t m_granularityShift;
+
+  std::unordered_map<uintptr_t, Line> m_lines;
+  std::unordered_set<uintptr_t> m_reads;
+  std::unordered_set<uintptr_t> m_writes;
+
+  // Accesses that straddle lines go through here
+  std::vector<uint8_t> m_scratch;
+  void *m_pendingAddr;
+  size_t m_pendingSize;
+};
+}
+
+#endif
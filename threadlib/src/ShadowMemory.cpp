@@ -0,0 +1,198 @@
+#include "ShadowMemory.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+
+#include <sys/mman.h>
+
+using namespace threadlib;
+
+extern "C" {
+ShadowLayout __threadlib_shadow = {nullptr, nullptr, 0, 0, 0};
+}
+
+static constexpr uint64_t NumRegions = 1ull << (ShadowMemory::AddrBits - ShadowMemory::RegionShift);
+static constexpr uint64_t RegionMask = (1ull << ShadowMemory::RegionShift) - 1;
+
+static constexpr uint64_t NumChunks = 1ull << (32 - ShadowMemory::CellChunkShift);
+static constexpr uint32_t CellsPerChunk = 1u << ShadowMemory::CellChunkShift;
+
+ShadowMemory::ShadowMemory(uint32_t granuleShift) 
+  : m_granuleShift(granuleShift), 
+    m_regionBytes((1ull << (RegionShift - granuleShift)) * sizeof(Slot)),
+    m_nextCell(1), 
+    m_generation(1) {
+  m_regions = new std::atomic<Slot *>[NumRegions]();
+  m_chunks = new std::atomic<ShadowCell *>[NumChunks]();
+
+  __threadlib_shadow = {m_regions, m_chunks, m_generation, m_granuleShift, sizeof(ShadowCell)};
+}
+
+ShadowMemory::~ShadowMemory(){
+  __threadlib_shadow = {nullptr, nullptr, 0, 0, 0};
+
+  for(uint64_t i = 0; i < NumRegions; i++){
+    Slot *region = m_regions[i].load();
+    if(region) munmap(region, m_regionBytes);
+  }
+
+  for(uint64_t i = 0; i < NumChunks; i++){
+    delete[] m_chunks[i].load();
+  }
+
+  delete[] m_regions;
+  delete[] m_chunks;
+}
+
+ShadowMemory::Slot *ShadowMemory::mapRegion(uint64_t region){
+  void *mem = mmap(nullptr, m_regionBytes,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+      -1, 0);
+
+  if(mem == MAP_FAILED) return nullptr;
+
+  Slot *expected = nullptr;
+  Slot *mapped = (Slot *)mem;
+  if(!m_regions[region].compare_exchange_strong(expected, mapped, std::memory_order_acq_rel)){
+    // Another thread mapped this region first
+    munmap(mem, m_regionBytes);
+    return expected;
+  }
+
+  return mapped;
+}
+
+ShadowMemory::Slot *ShadowMemory::getSlot(void *addr){
+  uintptr_t a = (uintptr_t)addr;
+  uint64_t region = a >> RegionShift;
+
+  Slot *base = m_regions[region].load(std::memory_order_acquire);
+  if(!base) base = mapRegion(region);
+  if(!base) return nullptr;
+
+  return base + ((a & RegionMask) >> m_granuleShift);
+}
+
+uint32_t ShadowMemory::allocateCell(){
+  uint32_t idx = m_nextCell.fetch_add(1, std::memory_order_relaxed);
+  if(idx == 0) {
+    std::cerr << "threadlib: shadow cell arena exhausted\n";
+    std::abort();
+  }
+
+  uint32_t chunk = idx >> CellChunkShift;
+  if(!m_chunks[chunk].load(std::memory_order_acquire)){
+    std::scoped_lock lock(m_chunkMutex);
+    if(!m_chunks[chunk].load(std::memory_order_relaxed)){
+      m_chunks[chunk].store(new ShadowCell[CellsPerChunk], std::memory_order_release);
+    }
+  }
+
+  return idx;
+}
+
+ShadowCell *ShadowMemory::cellAt(uint32_t idx){
+  ShadowCell *chunk = m_chunks[idx >> CellChunkShift].load(std::memory_order_acquire);
+  assert(chunk && "shadow cell chunk is not allocated");
+  return chunk + (idx & (CellsPerChunk - 1));
+}
+
+ShadowCell *ShadowMemory::getCell(void *addr, const void *owner, bool &created){
+  created = false;
+
+  Slot *slot = getSlot(addr);
+  if(!slot) return nullptr;
+
+  uint64_t generation = m_generation.load(std::memory_order_relaxed);
+  uint64_t head = slot->load(std::memory_order_acquire);
+
+  uint32_t newIdx = 0;
+  ShadowCell *newCell = nullptr;
+
+  while(true){
+    // Slots from an older generation are treated as empty
+    uint32_t first = (head >> 32) == generation ? (uint32_t)head : 0;
+
+    for(uint32_t idx = first; idx; ){
+      ShadowCell *cell = cellAt(idx);
+      if(cell->m_owner == owner) {
+        // Lost a race to create this cell, newCell stays unused until reset
+        if(newCell) newCell->m_owner = nullptr;
+        return cell;
+      }
+      idx = cell->m_next;
+    }
+
+    if(!newCell){
+      newIdx = allocateCell();
+      newCell = cellAt(newIdx);
+      newCell->m_owner = owner;
+      newCell->m_history.clear();
+      newCell->m_saved = 0;
+    }
+    newCell->m_next = first;
+
+    uint64_t value = (generation << 32) | newIdx;
+    if(slot->compare_exchange_weak(head, value, std::memory_order_acq_rel, std::memory_order_acquire)){
+      created = true;
+      return newCell;
+    }
+  }
+}
+
+void ShadowMemory::reset(){
+  uint32_t generation = m_generation.load(std::memory_order_relaxed) + 1;
+  if(generation == 0) generation = 1;
+
+  m_generation.store(generation, std::memory_order_relaxed);
+  m_nextCell.store(1, std::memory_order_relaxed);
+  __threadlib_shadow.m_generation = generation;
+}
+
+ShadowCell *ShadowTracker::getCell(void *addr){
+  if(!m_shadow->covers(addr)) return nullptr;
+
+  bool created;
+  ShadowCell *cell = m_shadow->getCell(addr, this, created);
+  if(created) m_cells++;
+  return cell;
+}
+
+bool ShadowTracker::checkLoad(void *addr, Task &task){
+  ShadowCell *cell = getCell(addr);
+  if(!cell) return m_fallback.checkLoad(addr, task);
+
+  return cell->m_history.load(task.getTimestamp(), task.getIteration());
+}
+
+bool ShadowTracker::checkStore(void *addr, Task &task, bool record, bool &newEntry){
+  ShadowCell *cell = getCell(addr);
+  if(!cell) return m_fallback.checkStore(addr, task, record, newEntry);
+
+  return cell->m_history.store(task.getTimestamp(), task.getIteration(), record, newEntry);
+}
+
+void ShadowTracker::markSaved(void *addr, size_t size, uint32_t granuleShift){
+  if(granuleShift > 6 || !size) return;
+
+  uintptr_t a = (uintptr_t)addr;
+  uintptr_t mask = ((uintptr_t)1 << granuleShift) - 1;
+  for(uintptr_t granule = a & ~mask; granule < a + size; granule += mask + 1){
+    ShadowCell *cell = getCell((void *)granule);
+    if(!cell) continue;
+
+    uintptr_t first = std::max(a, granule) - granule;
+    uintptr_t last = std::min(a + size, granule + mask + 1) - granule;
+    uint64_t bytes = last - first >= 64 ? ~0ull : ((1ull << (last - first)) - 1) << first;
+    cell->m_saved.fetch_or(bytes, std::memory_order_relaxed);
+  }
+}
+
+void ShadowTracker::printHistory(){
+  std::cout << "Shadow cells: " << m_cells << "\n";
+  m_fallback.printHistory();
+}
@@ -0,0 +1,116 @@
+#ifndef SHADOWMEMORY_H
+#define SHADOWMEMORY_H
+
+#include "ConflictTracker.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace threadlib {
+
+// History for one granule as seen by one owner. Cells for the same granule
+// are chained through m_next, which only happens when several JobStates
+// touch the same address within one generation.
+struct ShadowCell {
+  const void *m_owner;
+  uint32_t m_next;
+
+  // Bytes of the granule the owner has saved in its undo log, only kept
+  // for granules of up to 64 bytes
+  std::atomic<uint64_t> m_saved;
+
+  AddrHistory m_history;
+};
+
+// Published as __threadlib_shadow for the inline checks InstrumentFunctionPass
+// emits with --inline-shadow-checks. They find the cell at the head of a
+// granule's slot the way ShadowMemory::getCell() does and load its fields at
+// the offsets below, so changing either means changing the pass to match.
+// The size of a cell depends on THREADLIB_MAX_DEPTH, so it is published too.
+// Everything is null while the shadow backend isn't in use.
+struct ShadowLayout {
+  std::atomic<std::atomic<uint64_t> *> *m_regions;
+  std::atomic<ShadowCell *> *m_chunks;
+  uint32_t m_generation;
+  uint32_t m_granuleShift;
+  uint32_t m_cellSize;
+};
+
+static_assert(offsetof(ShadowCell, m_owner) == 0, "inline shadow checks load m_owner at 0");
+static_assert(offsetof(ShadowCell, m_saved) == 16, "inline shadow checks load m_saved at 16");
+static_assert(offsetof(ShadowCell, m_history) == 24, "inline shadow checks load m_writer at 24");
+static_assert(offsetof(AddrHistory, m_reader) == 8, "inline shadow checks load m_reader at 32");
+
+// Direct-mapped shadow memory. Every granule of the application address
+// space maps to a fixed 64 bit slot at
+//   region[addr >> RegionShift] + ((addr & RegionMask) >> m_granuleShift)
+// where each 4GB region of application memory gets its shadow reserved with
+// mmap(MAP_NORESERVE) the first time it is touched, so only pages that hold
+// live slots are ever backed. A slot holds (generation << 32 | cell index);
+// reset() bumps the generation, which invalidates every slot at once and
+// recycles the cell arena without touching the shadow pages.
+class ShadowMemory {
+public:
+  static constexpr uint32_t RegionShift = 32;
+  static constexpr uint32_t AddrBits = 47;
+  static constexpr uint32_t CellChunkShift = 16;
+
+  ShadowMemory(uint32_t granuleShift);
+  ~ShadowMemory();
+
+  bool covers(void *addr){
+    return ((uintptr_t)addr >> AddrBits) == 0;
+  }
+
+  // Returns owner's cell for addr, creating it if needed and setting created.
+  // Returns nullptr if the shadow for addr could not be mapped.
+  ShadowCell *getCell(void *addr, const void *owner, bool &created);
+
+  void reset();
+
+protected:
+  using Slot = std::atomic<uint64_t>;
+
+  Slot *getSlot(void *addr);
+  Slot *mapRegion(uint64_t region);
+
+  uint32_t allocateCell();
+  ShadowCell *cellAt(uint32_t idx);
+
+protected:
+  uint32_t m_granuleShift;
+  uint64_t m_regionBytes;
+
+  std::atomic<Slot *> *m_regions;
+  std::atomic<ShadowCell *> *m_chunks;
+
+  std::atomic<uint32_t> m_nextCell;
+  std::atomic<uint32_t> m_generation;
+
+  std::mutex m_chunkMutex;
+};
+
+class ShadowTracker : public ConflictTracker {
+public:
+  ShadowTracker(ShadowMemory *shadow) : m_shadow(shadow), m_cells(0) {}
+
+  bool checkLoad(void *addr, Task &task) override;
+  bool checkStore(void *addr, Task &task, bool record, bool &newEntry) override;
+  void markSaved(void *addr, size_t size, uint32_t granuleShift) override;
+
+  void printHistory() override;
+
+protected:
+  ShadowMemory *m_shadow;
+  std::atomic<uint64_t> m_cells;
+
+  // Addresses the shadow cannot cover
+  TableTracker m_fallback;
+
+  ShadowCell *getCell(void *addr);
+};
+}
+
+#endif
@@ -0,0 +1,153 @@
+#include "Signature.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+
+using namespace threadlib;
+
+static uint32_t log2Ceil(uint32_t value){
+  uint32_t bits = 0;
+  while((1u << bits) < value) bits++;
+  return bits;
+}
+
+// The signature is split into one partition per hash function, so an
+// address shared by two signatures sets a common bit in every partition
+BloomSignature::BloomSignature(uint32_t bits, uint32_t hashes) : m_hashes(hashes ? hashes : 1) {
+  uint32_t partitionBits = std::max(64u, bits / m_hashes);
+  partitionBits = 1u << log2Ceil(partitionBits);
+
+  m_shift = 64 - log2Ceil(partitionBits);
+  m_words.resize((size_t)m_hashes * partitionBits / 64);
+}
+
+uint32_t BloomSignature::getBit(void *addr, uint32_t hash) const {
+  uint64_t multiplier = (0x9E3779B97F4A7C15ull + hash * 0xD6E8FEB86659FD93ull) | 1;
+  uint64_t partitionBits = 1ull << (64 - m_shift);
+  return hash * partitionBits + ((uint64_t)(uintptr_t)addr * multiplier >> m_shift);
+}
+
+void BloomSignature::insert(void *addr){
+  for(uint32_t i = 0; i < m_hashes; i++){
+    uint32_t bit = getBit(addr, i);
+    m_words[bit / 64] |= 1ull << (bit % 64);
+  }
+}
+
+bool BloomSignature::intersects(const BloomSignature &other) const {
+  assert(m_words.size() == other.m_words.size() && "mismatched signature sizes");
+
+  size_t partitionWords = m_words.size() / m_hashes;
+  for(uint32_t i = 0; i < m_hashes; i++){
+    bool shared = false;
+    for(size_t w = i * partitionWords; w < (i + 1) * partitionWords && !shared; w++){
+      shared = m_words[w] & other.m_words[w];
+    }
+
+    if(!shared) return false;
+  }
+
+  return true;
+}
+
+static bool sharesAddr(const std::vector<void *> &lhs, const std::vector<void *> &rhs){
+  auto l = lhs.begin(), r = rhs.begin();
+  while(l != lhs.end() && r != rhs.end()){
+    if(*l == *r) return true;
+    if(*l < *r) l++;
+    else r++;
+  }
+  return false;
+}
+
+bool TaskSignature::overlaps(const TaskSignature &other) const {
+  if(m_writes.intersects(other.m_reads) && sharesAddr(m_writeLog, other.m_readLog)) return true;
+  if(m_writes.intersects(other.m_writes) && sharesAddr(m_writeLog, other.m_writeLog)) return true;
+  if(m_reads.intersects(other.m_writes) && sharesAddr(m_readLog, other.m_writeLog)) return true;
+  return false;
+}
+
+bool SignatureTracker::checkLoad(void *addr, Task &task){
+  TaskSignature *sig = task.getSignature();
+  assert(sig && "task was not started");
+
+  sig->m_reads.insert(addr);
+  if(sig->m_readLog.empty() || sig->m_readLog.back() != addr) sig->m_readLog.push_back(addr);
+  return false;
+}
+
+bool SignatureTracker::checkStore(void *addr, Task &task, bool, bool &newEntry){
+  TaskSignature *sig = task.getSignature();
+  assert(sig && "task was not started");
+
+  sig->m_writes.insert(addr);
+  newEntry = sig->m_writeLog.empty() || sig->m_writeLog.back() != addr;
+  if(newEntry) sig->m_writeLog.push_back(addr);
+  return false;
+}
+
+SignatureTracker::~SignatureTracker(){
+  for(FinishedTask &finished : m_finished) delete finished.m_signature;
+}
+
+void SignatureTracker::startTask(Task &task){
+  TaskSignature *sig = task.getSignature();
+  if(!sig) {
+    sig = new TaskSignature(m_bits, m_hashes);
+    task.setSignature(sig);
+  }
+
+  std::scoped_lock lock(m_mutex);
+  sig->m_start = m_clock++;
+  sig->m_inverted = m_latestFinished > task.getTimestamp();
+}
+
+bool SignatureTracker::finishTask(Task &task){
+  TaskSignature *sig = task.getSignature();
+  assert(sig && "task was not started");
+
+  for(auto *log : {&sig->m_readLog, &sig->m_writeLog}){
+    std::sort(log->begin(), log->end());
+    log->erase(std::unique(log->begin(), log->end()), log->end());
+  }
+
+  const Timestamp &t = task.getTimestamp();
+  bool conflict = false;
+
+  std::scoped_lock lock(m_mutex);
+  sig->m_end = m_clock++;
+
+  for(auto it = m_finished.rbegin(); it != m_finished.rend() && !conflict; it++){
+    TaskSignature *otherSig = it->m_signature;
+
+    // Tasks that finished before this one started ran in timestamp order
+    // unless they are later than it
+    if(otherSig->m_end <= sig->m_start){
+      if(!sig->m_inverted) break;
+      if(!(it->m_timestamp > t)) continue;
+    }
+
+    conflict = sig->overlaps(*otherSig);
+  }
+
+  m_finished.push_back({sig, t});
+  task.setSignature(nullptr);
+  if(t > m_latestFinished) m_latestFinished = t;
+
+  return conflict;
+}
+
+void SignatureTracker::printHistory(){
+  std::scoped_lock lock(m_mutex);
+
+  size_t reads = 0, writes = 0;
+  for(FinishedTask &finished : m_finished){
+    reads += finished.m_signature->m_readLog.size();
+    writes += finished.m_signature->m_writeLog.size();
+  }
+
+  std::cout << "Finished tasks: " << m_finished.size()
+            << " Reads: " << reads << " Writes: " << writes << "\n";
+}
@@ -0,0 +1,94 @@
+#ifndef SIGNATURE_H
+#define SIGNATURE_H
+
+#include "ConflictTracker.h"
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace threadlib {
+
+// Fixed-size Bloom filter over addresses, modelled on the read/write set
+// signatures used by hardware transactional memory. Each address sets one bit
+// per hash function, so two signatures that share no bits share no addresses.
+class BloomSignature {
+public:
+  BloomSignature(uint32_t bits, uint32_t hashes);
+
+  void insert(void *addr);
+  bool intersects(const BloomSignature &other) const;
+
+protected:
+  uint32_t getBit(void *addr, uint32_t hash) const;
+
+  std::vector<uint64_t> m_words;
+  uint32_t m_shift;
+  uint32_t m_hashes;
+};
+
+// Read and write sets of one task. The signatures are used to rule out
+// conflicts cheaply, and the exact logs confirm a signature hit.
+struct TaskSignature {
+  TaskSignature(uint32_t bits, uint32_t hashes)
+    : m_reads(bits, hashes), m_writes(bits, hashes),
+      m_start(0), m_end(0), m_inverted(false){}
+
+  BloomSignature m_reads;
+  BloomSignature m_writes;
+
+  std::vector<void *> m_readLog;
+  std::vector<void *> m_writeLog;
+
+  // Positions in the tracker's clock when the task started and finished
+  uint64_t m_start;
+  uint64_t m_end;
+
+  // Set if a task with a later timestamp had already finished when this one
+  // started
+  bool m_inverted;
+
+  bool overlaps(const TaskSignature &other) const;
+};
+
+// Signature based conflict detection. Accesses only touch the running
+// task's own signature, so there is no shared state on the hot path. When a
+// task finishes it is validated against every finished task it could have
+// been reordered with: those that ran concurrently with it, and those with a
+// later timestamp that finished before it. Any write shared with one of them
+// is a conflict, regardless of the order the accesses happened in.
+class SignatureTracker : public ConflictTracker {
+public:
+  SignatureTracker(uint32_t bits, uint32_t hashes)
+    : m_bits(bits), m_hashes(hashes), m_clock(0){}
+  ~SignatureTracker();
+
+  bool checkLoad(void *addr, Task &task) override;
+  bool checkStore(void *addr, Task &task, bool record, bool &newEntry) override;
+
+  void startTask(Task &task) override;
+  bool finishTask(Task &task) override;
+  bool validatesTasks() override { return true; }
+  bool findsFirstWrites() override { return false; }
+
+  void printHistory() override;
+
+protected:
+  uint32_t m_bits;
+  uint32_t m_hashes;
+
+  std::mutex m_mutex;
+  uint64_t m_clock;
+  Timestamp m_latestFinished;
+
+  // Signatures of the finished tasks in the order they finished, taken over
+  // from the tasks along with their timestamps
+  struct FinishedTask {
+    TaskSignature *m_signature;
+    Timestamp m_timestamp;
+  };
+  std::vector<FinishedTask> m_finished;
+};
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef STEALQUEUE_H
+#define STEALQUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+namespace threadlib {
+
+// One priority queue per worker, with stealing. A worker pops the oldest item
+// of its own queue, and once that is empty takes the oldest item of whichever
+// queue has the oldest front, so items still run roughly oldest first while
+// workers only contend with each other when stealing. Compare(a, b) is true
+// when a is newer than b, as for std::priority_queue.
+template<class T, class Compare>
+class StealQueue {
+public:
+  StealQueue(uint32_t numQueues) : m_queues(numQueues ? numQueues : 1), m_next(0){}
+
+  // Spreads the items over the queues round-robin, taking each queue's lock
+  // once
+  template<class It>
+  void push(It begin, It end){
+    uint32_t numQueues = m_queues.size();
+    size_t count = end - begin;
+    uint32_t first = m_next.fetch_add(count) % numQueues;
+
+    for(uint32_t i = 0; i < numQueues && i < count; i++){
+      Queue &queue = m_queues[(first + i) % numQueues];
+      std::scoped_lock lock(queue.m_mutex);
+
+      for(size_t j = i; j < count; j += numQueues) queue.m_items.push(begin[j]);
+      queue.m_count.store(queue.m_items.size(), std::memory_order_relaxed);
+    }
+  }
+
+  void push(T item){
+    push(&item, &item + 1);
+  }
+
+  // Queues the item for one worker, which others only get by stealing
+  void pushTo(uint32_t worker, T item){
+    Queue &queue = m_queues[worker % m_queues.size()];
+    std::scoped_lock lock(queue.m_mutex);
+
+    queue.m_items.push(item);
+    queue.m_count.store(queue.m_items.size(), std::memory_order_relaxed);
+  }
+
+  bool pop(uint32_t worker, T &item){
+    if(popFrom(m_queues[worker % m_queues.size()], item)) return true;
+    return steal(item);
+  }
+
+protected:
+  struct alignas(64) Queue {
+    std::mutex m_mutex;
+    std::priority_queue<T, std::vector<T>, Compare> m_items;
+
+    // Lets thieves skip empty queues without locking them
+    std::atomic<size_t> m_count{0};
+  };
+
+  bool popFrom(Queue &queue, T &item){
+    if(!queue.m_count.load(std::memory_order_relaxed)) return false;
+
+    std::scoped_lock lock(queue.m_mutex);
+    if(queue.m_items.empty()) return false;
+
+    item = queue.m_items.top();
+    queue.m_items.pop();
+    queue.m_count.store(queue.m_items.size(), std::memory_order_relaxed);
+    return true;
+  }
+
+  // The queue with the oldest front found so far stays locked, as once
+  // popped its front may be reused before the other queues are compared
+  // against it. Queues are locked in order, so thieves can't deadlock
+  bool steal(T &item){
+    Queue *victim = nullptr;
+    std::unique_lock<std::mutex> victimLock;
+
+    for(Queue &queue : m_queues){
+      if(!queue.m_count.load(std::memory_order_relaxed)) continue;
+
+      std::unique_lock lock(queue.m_mutex);
+      if(queue.m_items.empty()) continue;
+      if(!victim || m_compare(victim->m_items.top(), queue.m_items.top())){
+        victim = &queue;
+        victimLock = std::move(lock);
+      }
+    }
+
+    if(!victim) return false;
+    item = victim->m_items.top();
+    victim->m_items.pop();
+    victim->m_count.store(victim->m_items.size(), std::memory_order_relaxed);
+    return true;
+  }
+
+protected:
+  std::vector<Queue> m_queues;
+  std::atomic<uint32_t> m_next;
+  Compare m_compare;
+};
+}
+
+#endif
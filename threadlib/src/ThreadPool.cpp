@@ -1,7 +1,15 @@
 #include "ThreadPool.h"
+#include "Affinity.h"
+#include "Config.h"
 #include "JobState.h"
+#include "RedoLog.h"
+#include "ShadowMemory.h"
+#include "Signature.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <csetjmp>
 #include <functional>
 
 
@@ -12,10 +20,83 @@ using namespace threadlib;
 
 std::atomic<uint32_t> Job::s_counter = 0; 
 
+// Set by dequeueTask on worker threads, so the lookups done for every
+// instrumented access need no lock
+static thread_local bool t_isWorker = false;
+static thread_local uint32_t t_worker = 0;
+static thread_local Task *t_currentTask = nullptr;
+
+// Where abortTask() unwinds the running task to
+static thread_local std::jmp_buf t_abortPoint;
+
+// Frame of runTask, every frame below it belongs to the running task
+static thread_local uintptr_t t_taskStackTop = 0;
+
+// Iterations this worker started, which numbers them apart from those of
+// the other workers
+static thread_local uint64_t t_iterations = 0;
+
+// The running task's shadow cell owner and the iteration it is on, which the
+// inline shadow checks compare cells against. m_owner stays null unless the
+// job can use them, sending those checks to the runtime
+struct InlineTask {
+  const void *m_owner;
+  uint64_t m_iteration;
+};
+
+extern "C" {
+__attribute__((tls_model("initial-exec"))) thread_local InlineTask __threadlib_task = {nullptr, 0};
+}
+
+static constexpr uint32_t SpinIterations = 1 << 10;
+static constexpr uint32_t YieldIterations = 64;
+
+static inline void cpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Spins, then yields, then blocks until ready() holds. Most waits for the
+// other workers are short, so this avoids a sleep and wakeup for them
+// without burning a core on the long ones
+template<class Ready, class Block>
+static void backoffWait(Ready &&ready, Block &&block){
+  for(uint32_t i = 0; i < SpinIterations; i++){
+    if(ready()) return;
+    cpuRelax();
+  }
+
+  for(uint32_t i = 0; i < YieldIterations; i++){
+    if(ready()) return;
+    std::this_thread::yield();
+  }
+
+  block();
+}
+
+static uint64_t getTime(){
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+Task::~Task(){
+  delete m_signature;
+  delete m_redoLog;
+}
+
 int64_t Task::getIndVar(){
   return m_indvar;
 }
 
+int64_t Task::getFirstIndVar(){
+  return m_timestamp[m_timestamp.size() - 1];
+}
+
+uint64_t Task::getCount(){
+  return m_count;
+}
+
 void *Task::getArgs(){
   return m_args;
 }
@@ -28,10 +109,60 @@ void Task::setNewScope(void *scope){
   m_newScope = scope;
 }
 
-const std::vector<int64_t> &Task::getTimestamp(){
+TaskSignature *Task::getSignature(){
+  return m_signature;
+}
+
+void Task::setSignature(TaskSignature *signature){
+  m_signature = signature;
+}
+
+RedoLog *Task::getRedoLog(){
+  return m_redoLog;
+}
+
+void Task::setRedoLog(RedoLog *log){
+  m_redoLog = log;
+}
+
+const Timestamp &Task::getTimestamp(){
+  return m_current;
+}
+
+const Timestamp &Task::getFirstTimestamp(){
   return m_timestamp;
 }
 
+// The worker's index goes in the top bits, so no two workers hand out the
+// same number and none is 0
+void Task::startIteration(){
+  m_iteration = ((uint64_t)(t_worker + 1) << 40) | ++t_iterations;
+  __threadlib_task.m_iteration = m_iteration;
+}
+
+// The job and the trackers let go of a task once it finished, apart from
+// nested jobs, so tasks that spawned one aren't recycled
+void Task::recycle(int64_t indvar, uint64_t count){
+  delete m_signature;
+  delete m_redoLog;
+
+  m_indvar = indvar;
+  m_count = count;
+  m_newScope = nullptr;
+  m_signature = nullptr;
+  m_redoLog = nullptr;
+  m_held.clear();
+  m_checks = 0;
+  m_iterationTask = nullptr;
+  m_timestamp = Timestamp(indvar);
+  m_current = m_timestamp;
+  m_iteration = 0;
+  m_done.store(false);
+}
+
+// Tasks cover disjoint ranges, so ordering them by their first iterations
+// orders every iteration. Unlike the current timestamp, this doesn't change
+// while another worker runs the task
 bool Task::operator>(Task const& right) const {
   return m_timestamp > right.m_timestamp;
 }
@@ -39,7 +170,26 @@ bool Task::operator>(Task const& right) const {
 void Task::exec(){
   assert(m_job && "parent is null!");
   
+  // Checked before every iteration, as iterations whose checks all hit the
+  // inline shadow fast path never reach abortTask(). The job is rolled back
+  // anyway, so the rest of the range is skipped
+  if(!m_job->m_state->noConflicts()) return;
+
+  startIteration();
   m_job->m_func(m_indvar, m_args);
+  m_job->m_state->finishIteration(this);
+  if(m_count == 1) return;
+
+  for(uint64_t i = 1; i < m_count; i++){
+    if(!m_job->m_state->noConflicts()) return;
+
+    m_indvar += m_step;
+    m_current = m_timestamp.sibling(m_indvar);
+    startIteration();
+
+    m_job->m_func(m_indvar, m_args);
+    m_job->m_state->finishIteration(this);
+  }
 }
 
 Job::Job(ThreadPool *threadpool,  
@@ -47,7 +197,8 @@ Job::Job(ThreadPool *threadpool,
     FunctionPtr func,
     FunctionPtr sequential,
     FunctionPtr continued,
-    Job *parent) 
+    Job *parent,
+    uint32_t numWorkers) 
 : m_threadpool(threadpool), 
   m_func(func), 
   m_sequentialBody(sequential), 
@@ -55,7 +206,19 @@ Job::Job(ThreadPool *threadpool,
   m_parent(parent), 
   m_state(state),
   m_priority(s_counter++),
-  m_future(m_taskFinished.get_future()){}
+  m_numWorkers(numWorkers && numWorkers < threadpool->getSize() ? numWorkers : threadpool->getSize()),
+  m_taskQueues(m_numWorkers),
+  m_stream(nullptr),
+  m_exhausted(true),
+  m_finished(false){}
+
+Job::~Job(){
+  if(m_stream) {
+    for(Task *task : m_stream->m_inFlight) delete task;
+    for(Task *task : m_stream->m_free) delete task;
+  }
+  delete m_stream;
+}
 
 JobState* Job::getState(){
   return m_state;
@@ -65,30 +228,71 @@ ThreadPool *Job::getThreadPool(){
   return m_threadpool;
 }
 
-Task *Job::popTask(){
+Task *Job::popTask(uint32_t worker){
+  // Workers past the job's limit go straight to waiting for it
+  Task *task = nullptr;
+  while(worker < m_numWorkers && m_state->noConflicts()){
+    // Checked before popping, as once the whole loop is queued no tasks are
+    // added and finding none left means this worker is done with the job
+    bool exhausted = m_exhausted.load(std::memory_order_acquire);
+    bool generated = false;
+    if(!exhausted && m_stream->m_refill.load(std::memory_order_relaxed) && m_streamMutex.try_lock()) {
+      generated = m_threadpool->generateTasks(this);
+      m_streamMutex.unlock();
+    }
+
+    if(m_taskQueues.pop(worker, task)) return task;
+    if(exhausted) break;
+
+    // The window is full until a running task finishes
+    if(!generated) std::this_thread::yield();
+  }
+
   m_mutex.lock();
+  m_waitingThreads.push_back(std::this_thread::get_id());
+  uint32_t size = m_waitingThreads.size();
+
+  if(size == m_threadpool->getSize()){
+    m_threadpool->finishJob(this);
+    m_mutex.unlock();
+    m_finished.store(true, std::memory_order_release);
+    wakeWaiting();
+  } else {
+    m_mutex.unlock();
+
+    auto ready = [this]{
+      m_state->helpRollback();
+      return m_finished.load(std::memory_order_acquire);
+    };
+    backoffWait(ready, [this, &ready]{
+      std::unique_lock lock(m_waitingMutex);
+      while(true){
+        m_waitCondition.wait(lock, [this]{ return m_finished.load(std::memory_order_acquire) || m_state->canHelpRollback(); });
+
+        lock.unlock();
+        if(ready()) return;
+        lock.lock();
+      }
+    });
+  }
 
-  if(m_taskQueue.empty() || !m_state->noConflicts()){
-    m_waitingThreads.push_back(std::this_thread::get_id());
-    uint32_t size = m_waitingThreads.size();
-
-    if(size == m_threadpool->getSize()){
-      m_threadpool->finishJob(this);
-      m_mutex.unlock();
-      m_taskFinished.set_value(); 
-    } else {
-      m_mutex.unlock();
-      m_future.wait();
-    }
+  return nullptr;
+}
 
-    return nullptr;
+void Job::wakeWaiting(){
+  // Taking the lock makes sure no waiter is between checking its condition
+  // and blocking
+  {
+  std::scoped_lock lock(m_waitingMutex);
   }
+  m_waitCondition.notify_all();
+}
 
-  Task *task = m_taskQueue.top();
-  m_taskQueue.pop();
-  
-  m_mutex.unlock();
-  return task;
+void Job::finishTask(Task *task){
+  if(!m_stream) return;
+
+  task->m_done.store(true);
+  m_stream->m_refill.store(true);
 }
 
 void Job::addTask(Task *newTask, Task *taskParent){
@@ -96,11 +300,33 @@ void Job::addTask(Task *newTask, Task *taskParent){
   if(!m_state->noConflicts()) return;
   
   if(taskParent) m_parentTasks.insert(taskParent);
-  m_taskQueue.push(newTask);
+  m_taskQueues.push(newTask);
+}
+
+void Job::addTasks(const std::vector<Task *> &newTasks, Task *taskParent){
+  std::scoped_lock lock(m_mutex);
+  if(!m_state->noConflicts()) return;
+  
+  if(taskParent) m_parentTasks.insert(taskParent);
+  m_taskQueues.push(newTasks.begin(), newTasks.end());
 }
 
 void ThreadPool::finishJob(Job *job){
-  if(!job->m_state->noConflicts()){
+  // Once tasks of a loop have spawned nested loops, the children of the
+  // committed iterations would have to run on their own, so only streamed
+  // loops without any keep the iterations before a conflict
+  bool partial = false;
+  if(job->m_stream) {
+    std::scoped_lock lock(m_jobMutex);
+    partial = m_childJobs.find(job) == m_childJobs.end();
+  }
+
+  Timestamp rejected;
+  Job *retry = nullptr;
+  if(job->m_state->commit(partial, rejected)) retry = resumeJob(job, rejected[rejected.size() - 1]);
+  else if(!job->m_state->noConflicts()){
+    job->m_state->startRollback();
+    job->wakeWaiting();
     job->m_state->rollback();
   }
 
@@ -110,7 +336,11 @@ void ThreadPool::finishJob(Job *job){
     assert(job->m_sequentialBody && "m_sequentialBody is null");
 
     FunctionPtr nextFunc = job->m_state->noConflicts() ? job->m_nextFunc : job->m_sequentialBody;
-    Job *nextJob = createJob(nextFunc, nullptr, nullptr, job, job->m_parent->m_state);  
+    Job *nextJob = nullptr;
+    {
+    std::scoped_lock lock(m_jobMutex);
+    nextJob = createJob(nextFunc, nullptr, nullptr, job, job->m_parent->m_state);  
+    }
     
     for(Task *task : job->m_parentTasks){
       void *scope = job->m_state->noConflicts() ? task->getNewScope() : task->getArgs();
@@ -120,6 +350,7 @@ void ThreadPool::finishJob(Job *job){
     }
   }
 
+  std::scoped_lock lock(m_jobMutex);
   if(job != m_activeJobs.top()){
     std::cout << "FINISHED JOB IS NOT AT FRONT OF THE QUEUE\n";
     std::cout << "finished job: " << job->m_priority << " job at front: " << m_activeJobs.top()->m_priority << "\n";
@@ -133,15 +364,73 @@ void ThreadPool::finishJob(Job *job){
       }
       m_childJobs.erase(job);
     }
+    if(retry) m_activeJobs.push(retry);
+    m_hasWork = !m_activeJobs.empty();
   }
 
   if(m_activeJobs.empty()) setPromise(job->m_state->noConflicts());
 }
 
-ThreadPool::ThreadPool(uint32_t numThreads) : m_size(numThreads), m_ready(false) {}
+// Runs the iterations of a streamed loop from indvar, the first iteration of
+// the task that failed validation, onwards as a new job. That task is now
+// the oldest, so it can't conflict again and every retry commits at least
+// one task
+Job *ThreadPool::resumeJob(Job *job, int64_t indvar){
+  LoopStream &stream = *job->m_stream;
+  uint64_t first = (indvar - stream.m_start) / stream.m_step;
+
+  Job *retry = nullptr;
+  {
+  std::scoped_lock lock(m_jobMutex);
+  m_jobMap.erase(job->m_func);
+  retry = createJob(job->m_func, job->m_sequentialBody, job->m_nextFunc, nullptr, nullptr, job->m_numWorkers);
+  }
+
+  startStream(retry, stream.m_start + (int64_t)first * stream.m_step, stream.m_step, stream.m_iterations - first, stream.m_args, stream.m_schedule);
+  return retry;
+}
+
+void ThreadPool::startStream(Job *job, int64_t start, int64_t step, uint64_t iterations, void *args, const LoopSchedule &schedule){
+  job->m_stream = new LoopStream{start, step, iterations, 0, Config::get().m_window, args, schedule, {}, {}, false};
+  job->m_exhausted = false;
+
+  std::scoped_lock lock(job->m_streamMutex);
+  generateTasks(job);
+}
+
+ThreadPool::ThreadPool(uint32_t numThreads) : m_size(numThreads), m_shadow(nullptr), m_idleWorkers(0), m_hasWork(false), m_shutdown(false) {
+  const Config &config = Config::get();
+  m_printStats = config.m_printStats;
+  m_collectStats = config.m_printStats || config.m_adaptive || !config.m_profilePath.empty();
+  m_idleTime = 0;
+  m_execTime = 0;
+  m_abortedTasks = 0;
+  m_checks = 0;
+
+  if(config.m_backend == ConflictBackend::Shadow) m_shadow = new ShadowMemory(config.m_granularityShift);
+
+  m_workerCpus = getWorkerCpus(config.m_affinity);
+
+  m_threads.reserve(m_size);
+  for(uint32_t i = 0; i < m_size; i++){
+    m_threads.push_back(std::thread(&ThreadPool::dequeueTask, this, i));
+  }
+}
 
 ThreadPool::~ThreadPool(){
   clear();
+
+  {
+  std::scoped_lock lock(m_jobMutex);
+  m_shutdown = true;
+  }
+  m_workCondition.notify_all();
+
+  for(std::thread &t : m_threads){
+    t.join();
+  }
+
+  delete m_shadow;
 }
 
 void ThreadPool::addTask(FunctionPtr func, 
@@ -150,22 +439,33 @@ void ThreadPool::addTask(FunctionPtr func,
     int64_t start, 
     int64_t step, int64_t end,
     FunctionPtr sequential, 
-    FunctionPtr continued){
+    FunctionPtr continued,
+    const LoopSchedule &schedule,
+    bool independent){
+
+  uint64_t iterations = start < end ? (uint64_t)(end - start - 1) / step + 1 : 0;
+
+  // Past THREADLIB_MAX_DEPTH a nested task would have no level left in its
+  // timestamp
+  if(t_currentTask && (t_currentTask->m_job->getState()->getVersioning() == Versioning::Lazy || 
+        t_currentTask->getTimestamp().size() >= Timestamp::MaxDepth)){
+    runNested(func, args, newScope, start, step, iterations, continued);
+    return;
+  }
 
-  std::thread::id tid = std::this_thread::get_id();  
   Job *job = nullptr;
+  bool topLevel = false;
   {
   std::scoped_lock jobLock(m_jobMutex);
   job = getJob(func); 
 
   if(!job) {
     Job *parent = nullptr;
-    {
-    std::scoped_lock taskLock(m_taskMutex);
-    Task *t = getTaskForThread(tid);    
-    if(t) parent = t->m_job;
-    }
-    job = createJob(func, sequential, continued, parent); 
+    if(t_currentTask) parent = t_currentTask->m_job;
+    // A nested loop still has to be checked against the enclosing one
+    JobState *state = independent && !parent ? createJobState(Versioning::None) : nullptr;
+    job = createJob(func, sequential, continued, parent, state, schedule.m_numThreads); 
+    topLevel = !parent;
   }
 
   }
@@ -173,35 +473,158 @@ void ThreadPool::addTask(FunctionPtr func,
 
   //std::cout << "For loop stats: start:" << start << " step:" << step << " final:" << end << "\n";  
    
-  for(int64_t i = start; i < end; i += step) {
-    Task *taskParent;
-    if(isMainThread(tid)){
-      taskParent = nullptr;
-    } else {
-      std::scoped_lock lock(m_taskMutex);
-      taskParent = getTaskForThread(tid);
-      taskParent->setNewScope(newScope);
-    }
-    Task *newTask = nullptr;
+  Task *taskParent = nullptr;
+  if(!isMainThread()){
+    taskParent = getIterationTask();
+    taskParent->setNewScope(newScope);
+    t_currentTask->m_hasNested = true;
+  }
+
+  if(topLevel) startStream(job, start, step, iterations, args, schedule);
+  else {
+    std::vector<Task *> newTasks;
     {
     std::scoped_lock lock(m_taskMutex);
-    newTask = createTask(i, args, taskParent, job);
+    for(uint64_t done = 0; done < iterations; ){
+      uint64_t count = std::min(getChunkSize(schedule, iterations - done, iterations, job->m_numWorkers), iterations - done);
+      newTasks.push_back(createTask(start + (int64_t)done * step, args, taskParent, job, count, step));
+      done += count;
     }
-    job->addTask(newTask, taskParent);
+    }
+    job->addTasks(newTasks, taskParent);
+  }
+
+  // Only hand a new top-level job to the workers once its first tasks are
+  // queued, or they could finish it early
+  if(topLevel){
+    {
+    std::scoped_lock lock(m_jobMutex);
+    m_activeJobs.push(job);
+    m_hasWork = true;
+    }
+    m_workCondition.notify_all();
   }
-  makeReady();
 }
 
-const Timestamp &ThreadPool::getTimestampForCurrentThread(){
-  Task *task = nullptr;
+// With lazy versioning, a nested loop and the rest of the body after it
+// run in the task that reached the loop. Their writes go to that task's redo
+// log, so they are committed or thrown away with the top-level iteration.
+// As child jobs they would be committed on their own, before the top-level
+// loop is known to be valid. Loops nested deeper than THREADLIB_MAX_DEPTH
+// run here too, checked as part of the iteration that reached them
+void ThreadPool::runNested(FunctionPtr func, void *args, void *newScope, int64_t start, int64_t step, uint64_t iterations, FunctionPtr continued){
+  int64_t indvar = t_currentTask->getIndVar();
+  JobState *state = t_currentTask->m_job->getState();
+
+  for(uint64_t i = 0; i < iterations; i++){
+    if(!state->noConflicts()) return;
+    func(start + (int64_t)i * step, args);
+  }
+  if(continued && state->noConflicts()) continued(indvar, newScope);
+}
+
+Task *ThreadPool::getTaskForCurrentThread(){
+  assert(t_currentTask && "task is null!");
+  return t_currentTask;
+}
+
+Task *ThreadPool::getIterationTask(){
+  Task *task = getTaskForCurrentThread();
+  if(task->m_count == 1) return task;
+
+  Task *iteration = task->m_iterationTask;
+  if(iteration && iteration->m_indvar == task->m_indvar) return iteration;
+
   {
   std::scoped_lock lock(m_taskMutex);
-  task = getTaskForThread(std::this_thread::get_id());
+  iteration = createTask(task->m_indvar, task->m_args, nullptr, task->m_job);
+  }
+  iteration->m_timestamp = task->getTimestamp();
+  iteration->m_current = iteration->m_timestamp;
+  task->m_iterationTask = iteration;
+  return iteration;
+}
+
+// Queues tasks for the stream's next iterations, as far as its window
+// allows. Called with the job's m_streamMutex held
+bool ThreadPool::generateTasks(Job *job){
+  LoopStream &stream = *job->m_stream;
+
+  // Cleared before looking at the tasks, so a task finishing after that
+  // sets it again and the window is refilled on a later pop
+  stream.m_refill.store(false);
+  while(!stream.m_inFlight.empty() && stream.m_inFlight.front()->m_done.load()){
+    Task *task = stream.m_inFlight.front();
+    stream.m_inFlight.pop_front();
+
+    if(!task->m_hasNested) stream.m_free.push_back(task);
+    else {
+      std::scoped_lock lock(m_taskMutex);
+      m_tasks.push_back(task);
+    }
+  }
+
+  uint64_t oldest = stream.m_generated;
+  if(!stream.m_inFlight.empty()) oldest = (stream.m_inFlight.front()->getFirstIndVar() - stream.m_start) / stream.m_step;
+  uint64_t limit = std::min(stream.m_iterations, oldest + stream.m_window);
+  if(stream.m_generated >= limit) {
+    if(stream.m_generated == stream.m_iterations) job->m_exhausted.store(true, std::memory_order_release);
+    return false;
+  }
+
+  // Leave room in the window for every worker to have a task
+  uint64_t maxChunk = std::max<uint64_t>(1, stream.m_window / job->m_numWorkers);
+
+  // Static blocks always go to the same worker, so a loop that runs again
+  // finds its data where that worker first touched it
+  bool fixed = stream.m_schedule.m_kind == Schedule::Static;
+  uint64_t block = getChunkSize(stream.m_schedule, stream.m_iterations, stream.m_iterations, job->m_numWorkers);
+
+  std::vector<Task *> newTasks;
+  std::vector<uint32_t> owners;
+  while(stream.m_generated < limit){
+    uint64_t remaining = stream.m_iterations - stream.m_generated;
+    uint64_t count = std::min({getChunkSize(stream.m_schedule, remaining, stream.m_iterations, job->m_numWorkers), maxChunk, limit - stream.m_generated});
+
+    int64_t indvar = stream.m_start + (int64_t)stream.m_generated * stream.m_step;
+    Task *task = nullptr;
+    if(stream.m_free.empty()) task = new Task(indvar, stream.m_args, nullptr, job, count, stream.m_step);
+    else {
+      task = stream.m_free.back();
+      stream.m_free.pop_back();
+      task->recycle(indvar, count);
+    }
+
+    newTasks.push_back(task);
+    if(fixed) owners.push_back((stream.m_generated / block) % job->m_numWorkers);
+
+    stream.m_inFlight.push_back(task);
+    stream.m_generated += count;
+  }
+
+  if(fixed) {
+    for(size_t i = 0; i < newTasks.size(); i++) job->m_taskQueues.pushTo(owners[i], newTasks[i]);
+  } else job->m_taskQueues.push(newTasks.begin(), newTasks.end());
+  if(stream.m_generated == stream.m_iterations) job->m_exhausted.store(true, std::memory_order_release);
+  return true;
+}
+
+uint64_t ThreadPool::getChunkSize(const LoopSchedule &schedule, uint64_t remaining, uint64_t iterations, uint32_t workers){
+  uint64_t chunk = schedule.m_chunkSize > 0 ? schedule.m_chunkSize : 0;
+
+  switch(schedule.m_kind){
+  case Schedule::Static:
+    return chunk ? chunk : (iterations + workers - 1) / workers;
+  case Schedule::Dynamic:
+    return chunk ? chunk : 1;
+  case Schedule::Guided:
+    return std::max(chunk ? chunk : 1, (remaining + workers - 1) / workers);
   }
-  assert(task && "task is null!");
+  return 1;
+}
 
-  const Timestamp &t = task->getTimestamp();
-  return t;
+ShadowMemory *ThreadPool::getShadowMemory(){
+  return m_shadow;
 }
 
 uint32_t ThreadPool::getSize(){
@@ -222,42 +645,34 @@ Job *ThreadPool::createJob(
     FunctionPtr sequential, 
     FunctionPtr continued, 
     Job *parent,
-    JobState *state){
+    JobState *state,
+    uint32_t numWorkers){
   assert((m_jobMap.find(func) == m_jobMap.end()) && "Job for function already exists!");
   
   //std::cout << "creating new job\n";
-  if(!state) state = createJobState();
-  Job *job = new Job(this, state, func, sequential, continued, parent);
+  if(!state) state = createJobState(Config::get().m_versioning);
+  Job *job = new Job(this, state, func, sequential, continued, parent, numWorkers);
   m_jobMap[func] = job;
 
   if(parent) m_childJobs[parent].push_back(job);
-  else m_activeJobs.push(job);
   m_jobs.push_back(job);
   return job;
 }
 
-Task *ThreadPool::createTask(int64_t indvar, void *args, Task *parent, Job *job){
-  Task *task = new Task(indvar, args, parent, job);
+Task *ThreadPool::createTask(int64_t indvar, void *args, Task *parent, Job *job, uint64_t count, int64_t step){
+  Task *task = new Task(indvar, args, parent, job, count, step);
   m_tasks.push_back(task);
   return task;
 }
 
-JobState *ThreadPool::createJobState(){
-  JobState *state = new JobState(this);
+JobState *ThreadPool::createJobState(Versioning versioning){
+  JobState *state = new JobState(this, versioning);
   m_states.push_back(state);
   return state;
 }
 
-bool ThreadPool::isMainThread(std::thread::id tid){
-  std::scoped_lock lock(m_isReady);
-  return m_threadIdSet.find(tid) == m_threadIdSet.end();
-}
-
-Task *ThreadPool::getTaskForThread(std::thread::id tid){
-  if(isMainThread(tid)) return nullptr;
-
-  const auto &it = m_taskMap.find(tid);  
-  return it == m_taskMap.end() ? nullptr : it->second; 
+bool ThreadPool::isMainThread(){
+  return !t_isWorker;
 }
 
 void ThreadPool::setPromise(bool value){
@@ -270,61 +685,99 @@ bool ThreadPool::wait(){
   return success.get();
 }
 
-void ThreadPool::makeReady(){
-  if(m_ready) return;
-  std::scoped_lock lock(m_isReady);
-  m_threads.reserve(m_size);
-  for(uint32_t i = 0; i < m_size; i++){
-    m_threads.push_back(std::thread(&ThreadPool::dequeueTask, this));
-    m_threadIdSet.insert(m_threads[i].get_id());
-  }
-  m_ready = true;
+void ThreadPool::park(std::unique_lock<std::mutex> &lock){
+  // Let clear() know this worker no longer touches any job or task
+  t_currentTask = nullptr;
+  m_idleWorkers++;
+  m_idleCondition.notify_all();
+  lock.unlock();
+
+  backoffWait([this]{ return m_hasWork || m_shutdown; }, [this]{
+    std::unique_lock parked(m_jobMutex);
+    m_workCondition.wait(parked, [this]{ return m_shutdown || !m_activeJobs.empty(); });
+  });
+
+  lock.lock();
+  m_idleWorkers--;
 }
 
-void ThreadPool::dequeueTask(){
+void ThreadPool::dequeueTask(uint32_t worker){
+  t_isWorker = true;
+  t_worker = worker;
+
+  // Pinned before the worker first touches any metadata, so that memory is
+  // placed on its node
+  if(!m_workerCpus.empty()) pinCurrentThread(m_workerCpus[worker % m_workerCpus.size()]);
+
+  uint64_t idleStart = m_collectStats ? getTime() : 0;
+
   while(true){
     Job *job = nullptr;
     Task *task = nullptr;
 
     {
-    std::scoped_lock lock(m_isReady);
-    if(!m_ready) continue;
+    std::unique_lock lock(m_jobMutex);
+    while(m_activeJobs.empty() && !m_shutdown){
+      // Time parked between top-level loops isn't counted
+      if(m_collectStats) m_idleTime += getTime() - idleStart;
+      park(lock);
+      if(m_collectStats) idleStart = getTime();
     }
-
-    {
-    std::scoped_lock lock(m_jobMutex);
-    if(m_activeJobs.empty()) break;
+    if(m_shutdown) break;
     job = m_activeJobs.top();
     }
 
     assert(job && "null job for dequeue");
-    task = job->popTask(); 
+    task = job->popTask(worker); 
     if(!task) {
       continue;
     }
 
-    {
-    std::scoped_lock lock(m_taskMutex);
-    m_taskMap[std::this_thread::get_id()] = task;
-    }
+    t_currentTask = task;
+
+    uint64_t execStart = m_collectStats ? getTime() : 0;
+    if(m_collectStats) m_idleTime += execStart - idleStart;
 
-    task->exec();
+    runTask(task);
+    t_currentTask = nullptr;
+
+    if(m_collectStats) {
+      idleStart = getTime();
+      m_execTime += idleStart - execStart;
+    }
   }
 }
 
+void ThreadPool::runTask(Task *task){
+  JobState *state = task->m_job->getState();
+  state->startTask(task);
+  t_taskStackTop = (uintptr_t)__builtin_frame_address(0);
+  __threadlib_task = {state->getInlineOwner(), 0};
+  if(!setjmp(t_abortPoint)) task->exec();
+  else if(m_collectStats) m_abortedTasks++;
+  __threadlib_task = {nullptr, 0};
+  t_taskStackTop = 0;
+  if(m_collectStats) m_checks += task->m_checks;
+  state->finishTask(task);
+  task->m_job->finishTask(task);
+}
+
 void ThreadPool::clear(){
+  std::unique_lock lock(m_jobMutex);
   assert(m_activeJobs.empty() && "tried to clear threadpool with active jobs!");
-  for(std::thread &t : m_threads){
-    t.join();
-  }
 
-  m_ready = false;
+  // The workers stay alive between jobs, wait until they're all parked
+  m_idleCondition.wait(lock, [this]{ return m_idleWorkers == m_size; });
+  if(m_printStats && !m_jobs.empty()) printStats();
+  m_idleTime = 0;
+  m_execTime = 0;
+  m_abortedTasks = 0;
+  m_checks = 0;
+
   m_promise = std::promise<bool>(); 
   
   m_jobMap.clear();
-  m_taskMap.clear();
-  m_threadIdSet.clear();
-  m_threads.clear();
+  m_childJobs.clear();
 
   for(Task *task : m_tasks) delete task;
   for(JobState *state : m_states) delete state;
@@ -333,5 +786,38 @@ void ThreadPool::clear(){
   m_tasks.clear();
   m_states.clear();
   m_jobs.clear();
+
+  if(m_shadow) m_shadow->reset();
 }
 
+void ThreadPool::printStats(){
+  std::cout << "Workers idle: " << m_idleTime / 1000 << "us"
+            << " executing: " << m_execTime / 1000 << "us"
+            << " aborted tasks: " << m_abortedTasks
+            << " checks: " << m_checks << "\n";
+}
+
+uint64_t ThreadPool::getExecTime(){
+  return m_execTime;
+}
+
+uint64_t ThreadPool::getChecks(){
+  return m_checks;
+}
+
+bool ThreadPool::isTaskPrivate(const void *addr, size_t size){
+  uintptr_t a = (uintptr_t)addr;
+  return a >= (uintptr_t)__builtin_frame_address(0) && a + size <= t_taskStackTop;
+}
+
+uint32_t ThreadPool::getWorker(){
+  return t_worker;
+}
+
+// Only called from the check functions the loop body calls, once the
+// runtime returned from the check. The frames between runTask and the body,
+// including those running a nested loop inline, hold no locks either
+void ThreadPool::abortTask(){
+  assert(t_currentTask && "no task to abort");
+  std::longjmp(t_abortPoint, 1);
+}
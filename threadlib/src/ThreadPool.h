@@ -1,12 +1,18 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
+#include "Config.h"
+#include "StealQueue.h"
+#include "Timestamp.h"
+
 #include <atomic>
+#include <condition_variable>
 #include <thread>
 #include <mutex>
 #include <future>
 
 #include <vector>
+#include <deque>
 #include <queue>
 #include <map>
 #include <set>
@@ -15,47 +21,139 @@
 namespace threadlib {
 
 using FunctionPtr = void(*)(int64_t, void*);
-using Timestamp = std::vector<int64_t>;
 
 class JobState;
+class ShadowMemory;
+class RedoLog;
+struct TaskSignature;
 class Job;
 class ThreadPool;
 
+// Accesses an iteration checked before making them, which are checked again
+// once it ends
+struct HeldRange {
+  void *m_base;
+  int64_t m_stride;
+  int64_t m_count;
+  size_t m_size;
+  bool m_write;
+};
+
+// Runs count iterations of a loop body, starting from indvar. Every
+// iteration gets its own timestamp, so conflicts are still detected between
+// iterations rather than between tasks.
 class Task {
 public:
-  Task(int64_t indvar, void *args, Task *parent, Job *job)
-    :  m_job(job), m_indvar(indvar), m_args(args), m_newScope(nullptr){
-    if(!parent) {
-      m_timestamp = std::vector<int64_t>();
-      m_timestamp.push_back(indvar);
-      return;
-    }
-
-    m_timestamp = parent->m_timestamp;
-    m_timestamp.push_back(indvar);
-  }
+  Task(int64_t indvar, void *args, Task *parent, Job *job, uint64_t count = 1, int64_t step = 1)
+    :  m_job(job), m_indvar(indvar), m_step(step), m_count(count), m_args(args), m_newScope(nullptr), 
+       m_signature(nullptr), m_redoLog(nullptr), m_checks(0), m_iterationTask(nullptr), m_hasNested(false), m_done(false),
+       m_timestamp(parent ? Timestamp(parent->getTimestamp(), indvar) : Timestamp(indvar)),
+       m_current(m_timestamp), m_iteration(0){}
+
+  ~Task();
 
   int64_t getIndVar();
+  int64_t getFirstIndVar();
+  uint64_t getCount();
   void *getArgs();
   void *getNewScope();
   void setNewScope(void *scope);
 
-  const std::vector<int64_t> &getTimestamp();
+  // Only used by the signature conflict backend
+  TaskSignature *getSignature();
+  void setSignature(TaskSignature *signature);
+
+  // Only used with lazy versioning
+  RedoLog *getRedoLog();
+  void setRedoLog(RedoLog *log);
+
+  // Only used with eager versioning
+  std::vector<HeldRange> &getHeldRanges(){
+    return m_held;
+  }
+
+  // The timestamp of the iteration running, or the first one before the
+  // task runs
+  const Timestamp &getTimestamp();
+  const Timestamp &getFirstTimestamp();
+
+  // Identifies the iteration running among every iteration the pool ran,
+  // which is all the inline shadow checks compare
+  uint64_t getIteration(){
+    return m_iteration;
+  }
+
+  // Counts an instrumented access, only read back with THREADLIB_STATS,
+  // THREADLIB_ADAPTIVE or THREADLIB_PROFILE
+  void countCheck(){
+    m_checks++;
+  }
   
   bool operator>(Task const& right) const;
   
   void exec();  
 
+  friend class Job;
   friend class ThreadPool;
 
 protected:
   Job *m_job;
 
   int64_t m_indvar; 
+  int64_t m_step;
+  uint64_t m_count;
   void *m_args;
   void *m_newScope;
+  TaskSignature *m_signature;
+  RedoLog *m_redoLog;
+  std::vector<HeldRange> m_held;
+  uint64_t m_checks;
+
+  // Single iteration task standing in for the current iteration as the
+  // parent of nested loops
+  Task *m_iterationTask;
+
+  // Set once the task spawned a nested loop, whose job keeps pointing at it
+  bool m_hasNested;
+
+  // Set once a task of a streamed loop finished, so the window can move
+  // past it
+  std::atomic<bool> m_done;
+
+  // Timestamps of the first iteration, which orders the task, and of the
+  // iteration running. The conflict trackers copy the latter, so it is
+  // overwritten for every iteration
+  Timestamp m_timestamp; 
+  Timestamp m_current;
+  uint64_t m_iteration;
+
+  void startIteration();
+
+  // Reuses a finished task of a streamed loop for the iterations from indvar
+  void recycle(int64_t indvar, uint64_t count);
+};
+
+// Iterations of a top-level loop that are turned into tasks as the job
+// runs. Only m_window iterations past the oldest unfinished task are
+// generated at a time, so a conflict stops the loop before the rest of it is
+// queued. The stream owns its tasks, so only those of the window are alive.
+struct LoopStream {
+  int64_t m_start;
+  int64_t m_step;
+  uint64_t m_iterations;
+  uint64_t m_generated;
+  uint64_t m_window;
+  void *m_args;
+  LoopSchedule m_schedule;
 
-  std::vector<int64_t> m_timestamp; 
+  // Generated tasks from the oldest unfinished one on, and finished tasks
+  // behind it that the next ones are made from. Only touched by the worker
+  // refilling the window
+  std::deque<Task *> m_inFlight;
+  std::vector<Task *> m_free;
+
+  // Set when a task finishes, as the window may have moved
+  std::atomic<bool> m_refill;
 };
 
 template<class T>
@@ -73,13 +171,22 @@ public:
       FunctionPtr func, 
       FunctionPtr sequential = nullptr, 
       FunctionPtr continued = nullptr, 
-      Job *parent = nullptr);
+      Job *parent = nullptr,
+      uint32_t numWorkers = 0);
+
+  ~Job();
   
   JobState *getState();
   ThreadPool *getThreadPool();
 
   void addTask(Task* newTask, Task* parentTask);
-  Task *popTask();
+  void addTasks(const std::vector<Task *> &newTasks, Task *parentTask);
+  Task *popTask(uint32_t worker);
+  void finishTask(Task *task);
+
+  // Called by the worker that finishes the job, once it has started rolling
+  // back or set m_finished
+  void wakeWaiting();
 
   bool operator>(Job const& right) const {
     return m_priority > right.m_priority; 
@@ -101,15 +208,28 @@ protected:
   uint32_t m_priority;
   
   std::set<Task *> m_parentTasks;
+
+  // Workers that take tasks of this job, the others only wait for it
+  uint32_t m_numWorkers;
   
-  std::priority_queue<Task *, std::vector<Task *>, PtrComparison<Task>> m_taskQueue;
+  // One queue per worker, oldest timestamp first
+  StealQueue<Task *, PtrComparison<Task>> m_taskQueues;
+
+  // Only set for top-level loops, m_exhausted once all of it is queued.
+  // Workers only take m_streamMutex to refill the window after a task
+  // finished, and skip the refill if another worker is already at it
+  LoopStream *m_stream;
+  std::atomic<bool> m_exhausted;
+  std::mutex m_streamMutex;
   
   std::vector<std::thread::id> m_waitingThreads;
 
-  std::promise<void> m_taskFinished;
-  std::shared_future<void> m_future;
+  // Workers done with the job wait on m_waitCondition until m_finished is
+  // set, or until a rollback gives them saved values to restore
+  std::atomic<bool> m_finished;
   std::mutex m_mutex;
   std::mutex m_waitingMutex;
+  std::condition_variable m_waitCondition;
 
   static std::atomic<uint32_t> s_counter; 
 };
@@ -119,52 +239,108 @@ public:
   ThreadPool(uint32_t numThreads);
   ~ThreadPool();
 
-  void addTask(FunctionPtr func, void *args, void *newScope, int64_t start, int64_t step, int64_t end, FunctionPtr seqBody, FunctionPtr restOfFunc);
+  // With independent set, the loop's iterations were proven not to depend on
+  // each other and its job runs them without tracking or versioning
+  void addTask(FunctionPtr func, void *args, void *newScope, int64_t start, int64_t step, int64_t end, FunctionPtr seqBody, FunctionPtr restOfFunc, const LoopSchedule &schedule, bool independent = false);
 
   void finishJob(Job *job);
 
   uint32_t getSize();
   Job *getJobInProgress();
-  bool isMainThread(std::thread::id tid = std::this_thread::get_id());
-  const Timestamp &getTimestampForCurrentThread();
+  bool isMainThread();
+  Task *getTaskForCurrentThread();
+
+  // Task for the iteration the current thread is running, which nested
+  // loops are spawned from
+  Task *getIterationTask();
+  ShadowMemory *getShadowMemory();
+
+  // True if [addr, addr + size) is in a frame the running task pushed on
+  // this worker's stack. Those frames die with the task, so no other task
+  // can see them and a rolled back task has nothing there to restore.
+  static bool isTaskPrivate(const void *addr, size_t size);
+
+  // Index of the worker the current thread is, from 0 to getSize()
+  static uint32_t getWorker();
+
+  // Queues the next tasks of a streamed loop, with its m_streamMutex held
+  bool generateTasks(Job *job);
+
+  // Unwinds the task running on this worker once its job has a conflict,
+  // leaving its writes to the rollback
+  [[noreturn]] void abortTask();
 
   void setPromise(bool value);
 
   bool wait();
   void clear();
+
+  // Nanoseconds the workers spent running tasks and the conflict checks the
+  // tasks made since the last clear(), only counted with THREADLIB_STATS,
+  // THREADLIB_ADAPTIVE or THREADLIB_PROFILE
+  uint64_t getExecTime();
+  uint64_t getChecks();
 protected:
   Job *getJob(FunctionPtr func);
-  Task *getTaskForThread(std::thread::id tid);
 
-  Job *createJob(FunctionPtr func, FunctionPtr sequential, FunctionPtr continued, Job* parent = nullptr, JobState* state = nullptr);
-  Task *createTask(int64_t indvar, void *args, Task *parent, Job *job);
-  JobState *createJobState();
+  Job *createJob(FunctionPtr func, FunctionPtr sequential, FunctionPtr continued, Job* parent = nullptr, JobState* state = nullptr, uint32_t numWorkers = 0);
+  Task *createTask(int64_t indvar, void *args, Task *parent, Job *job, uint64_t count = 1, int64_t step = 1);
+  uint64_t getChunkSize(const LoopSchedule &schedule, uint64_t remaining, uint64_t iterations, uint32_t workers);
+  JobState *createJobState(Versioning versioning);
 
-  void makeReady();
-  void dequeueTask();
+  void runNested(FunctionPtr func, void *args, void *newScope, int64_t start, int64_t step, uint64_t iterations, FunctionPtr continued);
+  void startStream(Job *job, int64_t start, int64_t step, uint64_t iterations, void *args, const LoopSchedule &schedule);
+  Job *resumeJob(Job *job, int64_t indvar);
+
+  void dequeueTask(uint32_t worker);
+  void runTask(Task *task);
+  void park(std::unique_lock<std::mutex> &lock);
+  void printStats();
 
 protected:
   uint32_t m_size;
-  bool m_ready;
 
   std::promise<bool> m_promise;
 
+  // Only allocated when the shadow conflict backend is selected
+  ShadowMemory *m_shadow;
+
   std::vector<std::thread> m_threads;
+
+  // CPU each worker pins itself to, empty unless THREADLIB_AFFINITY is set
+  std::vector<int> m_workerCpus;
+
+  // Tasks of nested loops, and those of streamed loops that nested jobs
+  // point at. The rest of a streamed loop's tasks belong to its LoopStream
   std::vector<Task *> m_tasks;
   std::vector<Job *> m_jobs;
   std::vector<JobState *> m_states;
   std::vector<void *> m_allocs;
 
-  std::set<std::thread::id> m_threadIdSet;
-
   std::priority_queue<Job *, std::vector<Job *>, PtrComparison<Job>> m_activeJobs;
   std::map<FunctionPtr, Job *> m_jobMap;
-  std::map<std::thread::id, Task *> m_taskMap;
   std::map<Job *, std::vector<Job *>> m_childJobs;
 
   std::mutex m_taskMutex;
   std::mutex m_jobMutex;
-  std::mutex m_isReady;
+
+  // Workers are started once and park on m_workCondition while there are no
+  // active jobs
+  std::condition_variable m_workCondition;
+  std::condition_variable m_idleCondition;
+  uint32_t m_idleWorkers;
+  std::atomic<bool> m_hasWork;
+  std::atomic<bool> m_shutdown;
+
+  // Nanoseconds the workers spent waiting for a task and running tasks, the
+  // tasks cut short by a conflict and the checks the tasks made, only
+  // counted with THREADLIB_STATS, THREADLIB_ADAPTIVE or THREADLIB_PROFILE
+  bool m_collectStats;
+  bool m_printStats;
+  std::atomic<uint64_t> m_idleTime;
+  std::atomic<uint64_t> m_execTime;
+  std::atomic<uint64_t> m_abortedTasks;
+  std::atomic<uint64_t> m_checks;
 };
 }
 
@@ -0,0 +1,79 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+// Deepest loop nest a task can be spawned from
+#ifndef THREADLIB_MAX_DEPTH
+#define THREADLIB_MAX_DEPTH 4
+#endif
+
+namespace threadlib {
+
+// Position of a task in the sequential execution: the induction variable of
+// every enclosing parallel loop, outermost first. Levels are stored inline
+// with the sign bit flipped so they order as unsigned integers and an unused
+// level (zero) sorts before any used one. Ordering is then a fixed number of
+// integer compares, with the depth breaking ties the way a prefix sorts first.
+class Timestamp {
+public:
+  static constexpr uint32_t MaxDepth = THREADLIB_MAX_DEPTH;
+
+  // No level set, which sorts before every other timestamp
+  Timestamp() : m_levels{}, m_depth(0){}
+
+  explicit Timestamp(int64_t indvar) : m_levels{encode(indvar)}, m_depth(1){}
+
+  // The pool runs loops nested deeper than MaxDepth inside the task that
+  // reaches them, so this only stops a level from being written past
+  // m_levels
+  Timestamp(const Timestamp &parent, int64_t indvar) : Timestamp(parent){
+    if(m_depth >= MaxDepth) {
+      std::cerr << "threadlib: loop nest is deeper than THREADLIB_MAX_DEPTH (" << MaxDepth << "), raise it\n";
+      std::abort();
+    }
+    m_levels[m_depth++] = encode(indvar);
+  }
+
+  // The timestamp of another iteration of the same loop
+  Timestamp sibling(int64_t indvar) const {
+    Timestamp next(*this);
+    next.m_levels[m_depth - 1] = encode(indvar);
+    return next;
+  }
+
+  uint32_t size() const {
+    return m_depth;
+  }
+
+  int64_t operator[](uint32_t i) const {
+    return (int64_t)(m_levels[i] ^ SignBit);
+  }
+
+  bool operator<(const Timestamp &right) const {
+    for(uint32_t i = 0; i < MaxDepth; i++){
+      if(m_levels[i] != right.m_levels[i]) return m_levels[i] < right.m_levels[i];
+    }
+    return m_depth < right.m_depth;
+  }
+
+  bool operator>(const Timestamp &right) const {
+    return right < *this;
+  }
+
+protected:
+  static constexpr uint64_t SignBit = 1ull << 63;
+
+  static uint64_t encode(int64_t indvar){
+    return (uint64_t)indvar ^ SignBit;
+  }
+
+protected:
+  uint64_t m_levels[MaxDepth];
+  uint32_t m_depth;
+};
+}
+
+#endif
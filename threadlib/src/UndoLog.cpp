@@ -0,0 +1,94 @@
+#include "UndoLog.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+using namespace threadlib;
+
+UndoLog::~UndoLog(){
+  for(Chunk &chunk : m_chunks) free(chunk.m_data);
+}
+
+UndoLog::Record *UndoLog::append(void *target, size_t size, uint64_t order){
+  size_t recordSize = getRecordSize(size);
+
+  if(m_chunks.empty() || m_chunks.back().m_capacity - m_chunks.back().m_used < recordSize){
+    size_t capacity = std::max(ChunkSize, recordSize);
+    m_chunks.push_back(Chunk{(uint8_t *)malloc(capacity), 0, capacity});
+  }
+
+  Chunk &chunk = m_chunks.back();
+  Record *record = (Record *)(chunk.m_data + chunk.m_used);
+  chunk.m_used += recordSize;
+
+  record->m_target = target;
+  record->m_size = size;
+  record->m_order = order;
+
+  m_records++;
+  return record;
+}
+
+void UndoLog::merge(UndoLog &other){
+  m_chunks.insert(m_chunks.end(), other.m_chunks.begin(), other.m_chunks.end());
+  m_records += other.m_records;
+
+  other.m_chunks.clear();
+  other.m_records = 0;
+}
+
+void UndoLog::restoreChunk(Chunk &chunk){
+  for(size_t offset = 0; offset < chunk.m_used; ){
+    Record *record = (Record *)(chunk.m_data + offset);
+    std::memcpy(record->m_target, record->getData(), record->m_size);
+    offset += getRecordSize(record->m_size);
+  }
+}
+
+void UndoLog::startRestore(bool disjoint){
+  m_nextChunk.store(0, std::memory_order_relaxed);
+  m_restoredChunks.store(0, std::memory_order_relaxed);
+  m_split.store(disjoint && m_chunks.size() > 1, std::memory_order_release);
+}
+
+bool UndoLog::hasChunksLeft(){
+  return m_split.load(std::memory_order_acquire) && m_nextChunk.load(std::memory_order_relaxed) < m_chunks.size();
+}
+
+void UndoLog::helpRestore(){
+  if(!m_split.load(std::memory_order_acquire)) return;
+
+  for(size_t i = m_nextChunk.fetch_add(1); i < m_chunks.size(); i = m_nextChunk.fetch_add(1)){
+    restoreChunk(m_chunks[i]);
+    m_restoredChunks.fetch_add(1, std::memory_order_release);
+  }
+}
+
+void UndoLog::restore(){
+  if(m_split.load(std::memory_order_relaxed)){
+    helpRestore();
+
+    // Chunks other threads took may still be in progress
+    while(m_restoredChunks.load(std::memory_order_acquire) < m_chunks.size()) std::this_thread::yield();
+    m_split.store(false, std::memory_order_relaxed);
+    return;
+  }
+
+  // The records of merged logs interleave, so they are put back in order
+  // first
+  std::vector<Record *> records;
+  records.reserve(m_records);
+  forEach([&](Record *record){
+    records.push_back(record);
+  });
+
+  std::sort(records.begin(), records.end(), [](Record *lhs, Record *rhs){
+    return lhs->m_order > rhs->m_order;
+  });
+
+  for(Record *record : records){
+    std::memcpy(record->m_target, record->getData(), record->m_size);
+  }
+}
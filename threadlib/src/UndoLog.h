@@ -0,0 +1,88 @@
+#ifndef UNDOLOG_H
+#define UNDOLOG_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace threadlib {
+
+// Saved values for eager versioning, bump allocated into large chunks so a
+// first write costs no allocation and the log is freed all at once. Each
+// record is a header followed by the saved bytes.
+class UndoLog {
+public:
+  struct Record {
+    void *m_target;
+    size_t m_size;
+
+    // Position of the save among those of every log merged into this one
+    uint64_t m_order;
+
+    void *getData(){
+      return this + 1;
+    }
+  };
+
+  static constexpr size_t ChunkSize = 1 << 20;
+
+  UndoLog() : m_records(0), m_split(false), m_nextChunk(0), m_restoredChunks(0){}
+  ~UndoLog();
+
+  // Reserves a record for size bytes at target. Not thread-safe, each
+  // worker appends to a log of its own
+  Record *append(void *target, size_t size, uint64_t order);
+
+  // Moves the records of other into this log
+  void merge(UndoLog &other);
+
+  // Restores every record, highest m_order first, so each byte ends up with
+  // the oldest value saved for it. With disjoint set in startRestore(), the
+  // records are known not to overlap, so the chunks of a large log can be
+  // restored in any order: other threads take them one at a time through
+  // helpRestore() until restore() returns
+  void startRestore(bool disjoint);
+  bool hasChunksLeft();
+  void helpRestore();
+  void restore();
+
+  template<class Fn>
+  void forEach(Fn &&fn){
+    for(Chunk &chunk : m_chunks){
+      for(size_t offset = 0; offset < chunk.m_used; ){
+        Record *record = (Record *)(chunk.m_data + offset);
+        fn(record);
+        offset += getRecordSize(record->m_size);
+      }
+    }
+  }
+
+  size_t size(){
+    return m_records;
+  }
+
+protected:
+  struct Chunk {
+    uint8_t *m_data;
+    size_t m_used;
+    size_t m_capacity;
+  };
+
+  static size_t getRecordSize(size_t size){
+    return sizeof(Record) + ((size + 7) & ~(size_t)7);
+  }
+
+  static void restoreChunk(Chunk &chunk);
+
+protected:
+  std::vector<Chunk> m_chunks;
+  size_t m_records;
+
+  std::atomic<bool> m_split;
+  std::atomic<size_t> m_nextChunk;
+  std::atomic<size_t> m_restoredChunks;
+};
+}
+
+#endif
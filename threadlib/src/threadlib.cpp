@@ -1,53 +1,220 @@
 #include "JobState.h"
+#include "LoopPolicy.h"
 #include "ThreadPool.h"
 
 #include <cassert>
+#include <chrono>
 #include <cstdlib>
 #include <mutex>
 
 #include <iostream>
 
-#define THREADS 4 
-
 using namespace threadlib;
 
 static ThreadPool *g_globalThreadPool = nullptr;
 static std::mutex m_initThreadPool;
 static std::vector<void *> g_allocs;
 
-extern "C" bool __enqueue_task(FunctionPtr func, FunctionPtr sequential, FunctionPtr continued, void* args, void* newScope, int64_t start, int64_t step, int64_t end){ 
+// Only kept with THREADLIB_ADAPTIVE or THREADLIB_PROFILE. Freed with the
+// pool, as static objects (Config included) are already destroyed when that
+// happens at exit
+static LoopPolicy *g_loopPolicy = nullptr;
+
+// Schedule of the loops the thread enqueues, set through __set_schedule
+static thread_local LoopSchedule t_schedule = Config::get().m_schedule;
+
+// Start the workers when the library is loaded so the first loop doesn't
+// wait for them
+__attribute__((constructor)) static void initThreadPool(){
+  std::scoped_lock lock(m_initThreadPool);
+  if(!g_globalThreadPool) g_globalThreadPool = new ThreadPool(Config::get().m_numThreads);
+
+  const Config &config = Config::get();
+  if(config.m_adaptive || !config.m_profilePath.empty()) g_loopPolicy = new LoopPolicy(config.m_profilePath);
+}
+
+__attribute__((destructor)) static void destroyThreadPool(){
+  std::scoped_lock lock(m_initThreadPool);
+  delete g_globalThreadPool;
+  g_globalThreadPool = nullptr;
+
+  if(g_loopPolicy) g_loopPolicy->writeProfile();
+  delete g_loopPolicy;
+  g_loopPolicy = nullptr;
+}
+
+static bool enqueue(FunctionPtr func, FunctionPtr sequential, FunctionPtr continued, void* args, void* newScope, int64_t start, int64_t step, int64_t end, bool independent){ 
   m_initThreadPool.lock();
-  if(!g_globalThreadPool) g_globalThreadPool = new ThreadPool(THREADS);
+  if(!g_globalThreadPool) g_globalThreadPool = new ThreadPool(Config::get().m_numThreads);
   m_initThreadPool.unlock();
 
   bool success = true;
+  bool topLevel = g_globalThreadPool->isMainThread();
+  bool tracked = topLevel && g_loopPolicy;
+
+  // Returning false runs the original loop instead
+  LoopSchedule schedule = t_schedule;
+  if(tracked && Config::get().m_adaptive && !g_loopPolicy->shouldSpeculate(func, schedule)) return false;
 
-  g_globalThreadPool->addTask(func, args, newScope, start, step, end, sequential, continued);
+  auto startTime = std::chrono::steady_clock::now();
+  g_globalThreadPool->addTask(func, args, newScope, start, step, end, sequential, continued, schedule, independent);
   
-  if(g_globalThreadPool->isMainThread()){   
+  if(topLevel){   
     success = g_globalThreadPool->wait();  
+
+    if(tracked) {
+      uint64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+      uint64_t iterations = start < end ? (uint64_t)(end - start - 1) / step + 1 : 0;
+      uint32_t numThreads = g_globalThreadPool->getSize();
+      if(schedule.m_numThreads && schedule.m_numThreads < numThreads) numThreads = schedule.m_numThreads;
+
+      g_loopPolicy->record(func, iterations, numThreads, success, time, g_globalThreadPool->getExecTime(), g_globalThreadPool->getChecks());
+    }
     g_globalThreadPool->clear();  
   }
 
   return success;
 }
 
-extern "C" void __check_load_conflict(void *addr){
+extern "C" bool __enqueue_task(FunctionPtr func, FunctionPtr sequential, FunctionPtr continued, void* args, void* newScope, int64_t start, int64_t step, int64_t end){ 
+  return enqueue(func, sequential, continued, args, newScope, start, step, end, false);
+}
+
+// For loops the compiler proved have no dependences between iterations,
+// which run in parallel without conflict checks or saved values
+extern "C" bool __enqueue_parallel_task(FunctionPtr func, FunctionPtr sequential, FunctionPtr continued, void* args, void* newScope, int64_t start, int64_t step, int64_t end){ 
+  return enqueue(func, sequential, continued, args, newScope, start, step, end, true);
+}
+
+// Sets how the loops this thread enqueues from now on are split into tasks:
+// kind is 0 for static, 1 for dynamic and 2 for guided, and a chunk of 0
+// uses the schedule's default
+extern "C" void __set_schedule(int32_t kind, int64_t chunk){
+  if(kind < (int32_t)Schedule::Static || kind > (int32_t)Schedule::Guided) {
+    std::cerr << "threadlib: unknown schedule " << kind << "\n";
+    return;
+  }
+
+  t_schedule.m_kind = (Schedule)kind;
+  t_schedule.m_chunkSize = chunk;
+}
+
+// Limits the loops this thread enqueues from now on to the first count
+// workers of the pool, 0 lets them use all of it
+extern "C" void __set_loop_threads(uint32_t count){
+  t_schedule.m_numThreads = count;
+}
+
+// Restarts the thread pool with count workers, or as many as there are CPUs
+// available if count is 0. Only the main thread can do this, between loops
+extern "C" void __set_num_threads(uint32_t count){
+  std::scoped_lock lock(m_initThreadPool);
+  if(g_globalThreadPool && !g_globalThreadPool->isMainThread()) {
+    std::cerr << "threadlib: __set_num_threads called from inside a loop\n";
+    return;
+  }
+
+  if(!count) count = Config::availableCpus();
+  if(g_globalThreadPool && g_globalThreadPool->getSize() == count) return;
+
+  delete g_globalThreadPool;
+  g_globalThreadPool = new ThreadPool(count);
+}
+
+// Unwinds the running task once its job has a conflict, as nothing it does
+// from here on can be kept. Only called by the checks below once the runtime
+// returned, so the frames skipped are the loop body's and hold no locks
+static void abortOnConflict(JobState *state){
+  if(!state->noConflicts()) g_globalThreadPool->abortTask();
+}
+
+extern "C" void *__check_load_conflict(void *addr, int64_t size){
+  if(ThreadPool::isTaskPrivate(addr, (size_t)size)) return addr;
+
+  assert(g_globalThreadPool && "globalThreadPool is nullptr!");
+  Job *job = g_globalThreadPool->getJobInProgress();
+  assert(job && "job pointer returned null!");
+
+  JobState *state = job->getState();
+  void *result = state->checkLoad(addr, (size_t)size);
+  abortOnConflict(state);
+  return result;
+}
+
+extern "C" void *__check_write_conflict(void *addr, int64_t size){
+  if(ThreadPool::isTaskPrivate(addr, (size_t)size)) return addr;
+
   assert(g_globalThreadPool && "globalThreadPool is nullptr!");
   Job *job = g_globalThreadPool->getJobInProgress();
   assert(job && "job pointer returned null!");
 
-  job->getState()->doesLoadConflict(addr);
-  job->getState()->addRead(addr);
+  JobState *state = job->getState();
+  void *result = state->checkStore(addr, (size_t)size);
+  abortOnConflict(state);
+  return result;
 }
 
-extern "C" void __check_write_conflict(void *addr, int64_t size){
+// Checks the compiler kept in place of later accesses to the same memory in
+// the iteration, which the runtime checks again when the iteration ends
+extern "C" void *__check_load_ahead(void *addr, int64_t size){
+  if(ThreadPool::isTaskPrivate(addr, (size_t)size)) return addr;
+
+  assert(g_globalThreadPool && "globalThreadPool is nullptr!");
+  Job *job = g_globalThreadPool->getJobInProgress();
+  assert(job && "job pointer returned null!");
+
+  JobState *state = job->getState();
+  void *result = state->checkLoadAhead(addr, (size_t)size);
+  abortOnConflict(state);
+  return result;
+}
+
+extern "C" void *__check_write_ahead(void *addr, int64_t size){
+  if(ThreadPool::isTaskPrivate(addr, (size_t)size)) return addr;
+
+  assert(g_globalThreadPool && "globalThreadPool is nullptr!");
+  Job *job = g_globalThreadPool->getJobInProgress();
+  assert(job && "job pointer returned null!");
+
+  JobState *state = job->getState();
+  void *result = state->checkStoreAhead(addr, (size_t)size);
+  abortOnConflict(state);
+  return result;
+}
+
+// Accesses to the running task's own frames need no check, a range only
+// ends up there if its first and last access do
+static bool isPrivateRange(void *base, int64_t stride, int64_t count, int64_t size){
+  return count > 0 && ThreadPool::isTaskPrivate(base, (size_t)size) && 
+      ThreadPool::isTaskPrivate((uint8_t *)base + (count - 1) * stride, (size_t)size);
+}
+
+// Check count accesses of size bytes, stride bytes apart from base, before
+// a loop makes them. Returning false leaves the loop to check each access
+extern "C" bool __check_read_range(void *base, int64_t stride, int64_t count, int64_t size){
+  if(isPrivateRange(base, stride, count, size)) return true;
+
+  assert(g_globalThreadPool && "globalThreadPool is nullptr!");
+  Job *job = g_globalThreadPool->getJobInProgress();
+  assert(job && "job pointer returned null!");
+
+  JobState *state = job->getState();
+  bool checked = state->checkLoadRange(base, stride, count, (size_t)size);
+  abortOnConflict(state);
+  return checked;
+}
+
+extern "C" bool __check_write_range(void *base, int64_t stride, int64_t count, int64_t size){
+  if(isPrivateRange(base, stride, count, size)) return true;
+
   assert(g_globalThreadPool && "globalThreadPool is nullptr!");
   Job *job = g_globalThreadPool->getJobInProgress();
   assert(job && "job pointer returned null!");
 
-  job->getState()->doesStoreConflict(addr);
-  job->getState()->addEntry(addr, (size_t)size);
+  JobState *state = job->getState();
+  bool checked = state->checkStoreRange(base, stride, count, (size_t)size);
+  abortOnConflict(state);
+  return checked;
 }
 
 extern "C" void* __malloc(int64_t size, int64_t num){
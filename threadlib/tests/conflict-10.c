@@ -0,0 +1,25 @@
+#include <stdio.h>
+
+int main(void) {
+    volatile long shared = 0;
+    volatile long diff[600];
+
+    // Both reads of shared see the same value when the iterations run in
+    // order, but with the iterations in parallel another one can write it
+    // between them, after the only check left for the two
+    for(int i = 0; i < 600; i++) {
+        long first = shared;
+        long work = (first * 31 + i) % 17;
+        long second = shared;
+        diff[i] = second - first + work % 2;
+        shared = i;
+    }
+
+    long sum = 0;
+    for(int i = 0; i < 600; i++) {
+        sum += diff[i];
+    }
+
+    printf("Final sum: %ld\nFinal shared: %ld\n", sum, shared);
+    return 0;
+}
@@ -0,0 +1,16 @@
+#include <stdio.h>
+
+int main(void) {
+    volatile long a[600];
+    volatile int *halves = (volatile int *)a;
+    a[0] = 0;
+
+    // Each iteration reads the upper half of the previous element, which
+    // overlaps the previous store without sharing its address
+    for(int i = 1; i < 600; i++) {
+        a[i] = (long)(halves[2 * i - 1] + 1) << 32;
+    }
+
+    printf("Final a: %ld\n", a[599] >> 32);
+    return 0;
+}
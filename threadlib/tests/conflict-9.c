@@ -0,0 +1,27 @@
+#include <stdio.h>
+
+int main(void) {
+    long a[8 * 600 + 17];
+
+    for(int i = 0; i < 8 * 600 + 17; i++) {
+        a[i] = i % 7;
+    }
+
+    // Each iteration carries a value through 16 elements, the first 8 of
+    // which the previous iteration went through too. The inner loop depends
+    // on its own earlier iterations, so it stays in the outer loop's body and
+    // the ranges checked before it on neighbouring iterations overlap
+    for(int i = 0; i < 600; i++) {
+        for(int j = 0; j < 16; j++) {
+            a[8 * i + j + 1] = (a[8 * i + j] + i) % 1000;
+        }
+    }
+
+    long sum = 0;
+    for(int i = 0; i < 8 * 600 + 17; i++) {
+        sum += a[i];
+    }
+
+    printf("Final sum: %ld\n", sum);
+    return 0;
+}